@@ -0,0 +1,365 @@
+#include <atomic>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+#include "Comms.h"
+#include "Latency.h"
+
+//Drives LocalServers through ping-pong, one-way streaming, fan-out and
+//fan-in, sweeping one parameter at a time away from a baseline: message
+//size, number of keys, number of receive events registered on the receiver
+//and number of concurrent clients. Events are swept twice: as header
+//matches, which the server indexes, and as arbitrary conditions, which
+//every message is tested against. Each case runs once over the shared ring
+//and once over the socket alone. Results go to stdout as JSON; progress goes
+//to stderr.
+//
+//Usage: comms_bench [--quick] [--messages n] [--pattern name] [--transport ring|socket]
+
+using namespace Sul::Comms;
+
+namespace {
+    typedef std::chrono::steady_clock Clock;
+
+    const char* Patterns[] = {"pingpong", "stream", "fanout", "fanin"};
+    const char* Transports[] = {"ring", "socket"};
+
+    struct Case {
+        std::string pattern;
+        std::string transport;
+        std::size_t size; //Bytes of values per message
+        std::size_t keys;
+        std::size_t events;
+        bool indexed; //Events are header matches rather than conditions
+        std::size_t clients;
+        std::size_t messages; //Per client
+    };
+
+    struct Result {
+        std::size_t sent = 0;
+        std::size_t delivered = 0;
+        double seconds = 0;
+        Sul::Latency::Histogram latency;
+    };
+
+    int64_t Now() {
+        return std::chrono::duration_cast<std::chrono::nanoseconds>(Clock::now().time_since_epoch()).count();
+    }
+
+    std::string CasePrefix;
+
+    //Node names must be unique per host, so each case gets its own prefix
+    std::string Name(std::string role, std::size_t index) {
+        return CasePrefix + role + std::to_string(index);
+    }
+
+    //'keys' keys whose values add up to 'size' bytes
+    void Fill(MessageBase& msg, Case const& c) {
+        for (std::size_t i = 0; i < c.keys; ++i) {
+            auto length = c.size / c.keys + (i < c.size % c.keys ? 1 : 0);
+            msg["k" + std::to_string(i)] = std::string(length, static_cast<char>('a' + i % 26));
+        }
+    }
+
+    //Receive events that never match. Header matches are looked up by
+    //value, so they cost little however many there are; conditions are each
+    //called on every message.
+    void AddEvents(ServerBase& server, Case const& c) {
+        for (std::size_t i = 0; i < c.events; ++i) {
+            auto key = "bench-miss" + std::to_string(i % 8);
+            auto value = std::to_string(i);
+
+            if (c.indexed) {
+                server.setReceiveEvent(ServerBase::Event(key, value), [](MessageBase&) {});
+            } else {
+                server.setReceiveEvent(ServerBase::Event([key, value](MessageBase const& msg) {
+                    return msg.get(key) == value;
+                }), [](MessageBase&) {});
+            }
+        }
+    }
+
+    //Records one-way latency from the "t" key and counts arrivals
+    struct Sink {
+        std::unique_ptr<LocalServer> server;
+        std::atomic<std::size_t> received{0};
+        Sul::Latency::Histogram latency;
+        std::thread thread;
+
+        Sink(std::string name, Case const& c): server(new LocalServer(name)) {
+            AddEvents(*server, c);
+            server->onMessageReceived([this](MessageBase& msg) {
+                if (msg.contains("t")) {
+                    latency.record(std::chrono::nanoseconds(Now() - std::stoll(msg["t"])));
+                    received.fetch_add(1, std::memory_order_release);
+                }
+            });
+            thread = std::thread([this]() {
+                server->listen(1);
+            });
+        }
+        ~Sink() {
+            stop();
+        }
+
+        void stop() {
+            if (thread.joinable()) {
+                server->stopListening();
+                thread.join();
+            }
+        }
+    };
+
+    //Waits for 'count' arrivals at the sinks or for the stream to stall
+    void AwaitDelivery(std::vector<std::unique_ptr<Sink>>& sinks, std::size_t count) {
+        std::size_t last = 0;
+        auto progress = Clock::now();
+
+        while (true) {
+            std::size_t received = 0;
+            for (auto& sink : sinks) {
+                received += sink->received.load(std::memory_order_acquire);
+            }
+            if (received >= count) {
+                return;
+            }
+
+            if (received != last) {
+                last = received;
+                progress = Clock::now();
+            } else if (Clock::now() - progress > std::chrono::seconds(2)) {
+                return;
+            }
+
+            std::this_thread::sleep_for(std::chrono::microseconds(200));
+        }
+    }
+
+    //Each client sends to its targets 'c.messages' times, stamping every
+    //message with the send time
+    void Send(Case const& c, std::vector<std::string> const& senders, std::vector<std::vector<std::string>> const& targets) {
+        std::vector<std::thread> threads;
+        for (std::size_t i = 0; i < senders.size(); ++i) {
+            threads.emplace_back([&c, &senders, &targets, i]() {
+                LocalServer server(senders[i]);
+                for (std::size_t n = 0; n < c.messages; ++n) {
+                    for (auto& target : targets[i]) {
+                        auto msg = server.acquireMessage();
+                        Fill(*msg, c);
+                        (*msg)["t"] = std::to_string(Now());
+                        msg->send(target);
+                    }
+                }
+            });
+        }
+
+        for (auto& thread : threads) {
+            thread.join();
+        }
+    }
+
+    void Stream(Case const& c, Result& result, std::size_t senders, std::size_t receivers, bool everySender) {
+        std::vector<std::unique_ptr<Sink>> sinks;
+        std::vector<std::string> sinkNames;
+        for (std::size_t i = 0; i < receivers; ++i) {
+            sinkNames.push_back(Name("sink", i));
+            sinks.emplace_back(new Sink(sinkNames.back(), c));
+        }
+
+        std::vector<std::string> senderNames;
+        std::vector<std::vector<std::string>> targets;
+        for (std::size_t i = 0; i < senders; ++i) {
+            senderNames.push_back(Name("source", i));
+            targets.push_back(everySender ? sinkNames : std::vector<std::string>{sinkNames[i % receivers]});
+        }
+
+        result.sent = senders * targets[0].size() * c.messages;
+        auto start = Clock::now();
+        Send(c, senderNames, targets);
+        AwaitDelivery(sinks, result.sent);
+        result.seconds = std::chrono::duration<double>(Clock::now() - start).count();
+
+        for (auto& sink : sinks) {
+            sink->stop(); //So its histogram can be read
+            result.delivered += sink->received.load();
+            result.latency.merge(sink->latency);
+        }
+    }
+
+    void PingPong(Case const& c, Result& result) {
+        LocalServer server(Name("server", 0));
+        AddEvents(server, c);
+        server.onMessageReceived([](MessageBase& msg) {
+            if (msg.contains("t")) {
+                msg.reply("t=" + msg["t"]);
+            }
+        });
+        std::thread listener([&server]() {
+            server.listen(1);
+        });
+
+        std::mutex lock;
+        std::vector<std::thread> clients;
+        auto start = Clock::now();
+        for (std::size_t i = 0; i < c.clients; ++i) {
+            clients.emplace_back([&, i]() {
+                LocalServer client(Name("client", i));
+                Sul::Latency::Histogram latency;
+                std::size_t delivered = 0;
+
+                for (std::size_t n = 0; n < c.messages; ++n) {
+                    auto msg = client.acquireMessage();
+                    Fill(*msg, c);
+                    auto sent = Now();
+                    (*msg)["t"] = std::to_string(sent);
+                    msg->send(server.getCliendID());
+
+                    try {
+                        while (client.awaitMessage(1000)->get("t") != (*msg)["t"]) {}
+                        latency.record(std::chrono::nanoseconds(Now() - sent));
+                        delivered++;
+                    } catch (std::runtime_error&) {
+                        //Timed out; counted as undelivered
+                    }
+                }
+
+                std::lock_guard<std::mutex> guard(lock);
+                result.latency.merge(latency);
+                result.delivered += delivered;
+            });
+        }
+
+        for (auto& client : clients) {
+            client.join();
+        }
+        result.seconds = std::chrono::duration<double>(Clock::now() - start).count();
+        result.sent = c.clients * c.messages;
+
+        server.stopListening();
+        listener.join();
+    }
+
+    Result Run(Case const& c, std::size_t index) {
+        CasePrefix = "bench-" + std::to_string(getpid()) + "-" + std::to_string(index) + "-";
+        setenv("SUL_RING_BYTES", c.transport == "socket" ? "0" : "", 1); //Read as each node is created
+
+        Result result;
+        if (c.pattern == "pingpong") {
+            PingPong(c, result);
+            return result;
+        }
+
+        if (c.pattern == "stream") {
+            Stream(c, result, 1, 1, false);
+        } else if (c.pattern == "fanout") {
+            Stream(c, result, 1, c.clients, true);
+        } else {
+            Stream(c, result, c.clients, 1, false);
+        }
+
+        return result;
+    }
+
+    const char* EventKind(Case const& c) {
+        return c.events == 0 ? "none" : c.indexed ? "indexed" : "condition";
+    }
+
+    void Print(Case const& c, Result const& r, bool first) {
+        auto latency = r.latency.summary();
+        printf("%s    {\"pattern\": \"%s\", \"transport\": \"%s\", \"size\": %zu, \"keys\": %zu, \"events\": %zu, \"event_kind\": \"%s\", \"clients\": %zu, "
+               "\"sent\": %zu, \"delivered\": %zu, \"seconds\": %.6f, \"msgs_per_sec\": %.1f, "
+               "\"latency_ns\": {\"count\": %llu, \"min\": %llu, \"mean\": %llu, \"p50\": %llu, \"p99\": %llu, \"p999\": %llu, \"max\": %llu}}",
+               first ? "" : ",\n", c.pattern.c_str(), c.transport.c_str(), c.size, c.keys, c.events, EventKind(c), c.clients,
+               r.sent, r.delivered, r.seconds, r.seconds > 0 ? r.delivered / r.seconds : 0.0,
+               (unsigned long long) latency.count, (unsigned long long) latency.min, (unsigned long long) latency.mean,
+               (unsigned long long) latency.p50, (unsigned long long) latency.p99, (unsigned long long) latency.p999,
+               (unsigned long long) latency.max);
+        fflush(stdout);
+    }
+}
+
+int main(int argc, char* argv[]) {
+    bool quick = false;
+    std::size_t messages = 0;
+    std::string onlyPattern, onlyTransport;
+
+    for (int i = 1; i < argc; ++i) {
+        std::string arg = argv[i];
+        if (arg == "--quick") {
+            quick = true;
+        } else if (arg == "--messages" && i + 1 < argc) {
+            messages = strtoul(argv[++i], nullptr, 10);
+        } else if (arg == "--pattern" && i + 1 < argc) {
+            onlyPattern = argv[++i];
+        } else if (arg == "--transport" && i + 1 < argc) {
+            onlyTransport = argv[++i];
+        } else {
+            fprintf(stderr, "Usage: %s [--quick] [--messages n] [--pattern pingpong|stream|fanout|fanin] [--transport ring|socket]\n", argv[0]);
+            return 1;
+        }
+    }
+    if (messages == 0) {
+        messages = quick ? 200 : 2000;
+    }
+
+    //Baseline, then each parameter swept with the others at the baseline
+    const Case base = {"", "", 64, 4, 0, false, 4, messages};
+    std::vector<std::size_t> sizes = {16, 256, 4096};
+    std::vector<std::size_t> keys = {1, 16, 64};
+    std::vector<std::size_t> events = {16, 256};
+    std::vector<std::size_t> clients = {1, 8};
+
+    std::vector<Case> cases;
+    for (auto pattern : Patterns) {
+        for (auto transport : Transports) {
+            if ((!onlyPattern.empty() && onlyPattern != pattern) || (!onlyTransport.empty() && onlyTransport != transport)) {
+                continue;
+            }
+
+            Case c = base;
+            c.pattern = pattern;
+            c.transport = transport;
+            c.clients = c.pattern == "stream" ? 1 : base.clients;
+            cases.push_back(c);
+
+            for (auto size : sizes) {
+                cases.push_back(c);
+                cases.back().size = size;
+            }
+            for (auto count : keys) {
+                cases.push_back(c);
+                cases.back().keys = count;
+            }
+            for (auto indexed : {true, false}) {
+                for (auto count : events) {
+                    cases.push_back(c);
+                    cases.back().events = count;
+                    cases.back().indexed = indexed;
+                }
+            }
+            if (c.pattern != "stream") {
+                for (auto count : clients) {
+                    cases.push_back(c);
+                    cases.back().clients = count;
+                }
+            }
+        }
+    }
+
+    printf("{\n  \"benchmark\": \"comms\",\n  \"messages_per_client\": %zu,\n  \"results\": [\n", messages);
+    for (std::size_t i = 0; i < cases.size(); ++i) {
+        auto& c = cases[i];
+        fprintf(stderr, "[%zu/%zu] %s %s size=%zu keys=%zu events=%zu (%s) clients=%zu\n", i + 1, cases.size(),
+                c.pattern.c_str(), c.transport.c_str(), c.size, c.keys, c.events, EventKind(c), c.clients);
+        Print(c, Run(c, i), i == 0);
+    }
+    printf("\n  ]\n}\n");
+
+    return 0;
+}
@@ -0,0 +1,108 @@
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <string>
+#include <vector>
+#include "Escape.h"
+
+//Compares the escape kernels against a character-at-a-time implementation
+//of SUL_messageEncode / SUL_messageDecode.
+//
+//Usage: escape_bench [iterations]
+
+namespace {
+    const std::string SpecialChars("&=|\x01", 4);
+
+    std::string ReferenceEncode(const std::string& msg) {
+        std::string ret;
+        for (std::size_t i = 0; i < msg.length(); ++i) {
+            if (SpecialChars.find(msg[i]) == std::string::npos) {
+                ret += msg[i];
+            } else {
+                ret += "|";
+                ret += msg[i];
+            }
+        }
+
+        return ret;
+    }
+
+    std::string ReferenceDecode(const std::string& msg) {
+        std::string ret;
+        for (std::size_t i = 0; i < msg.length(); ++i) {
+            if (msg[i] == '|') {
+                ret += msg[++i];
+            } else {
+                ret += msg[i];
+            }
+        }
+
+        return ret;
+    }
+
+    //Printable payload with roughly one special character per 'spacing' bytes
+    std::string Payload(std::size_t length, std::size_t spacing) {
+        std::string payload(length, ' ');
+        for (auto& c : payload) {
+            c = static_cast<char>('a' + rand() % 26);
+        }
+        if (spacing) {
+            for (std::size_t i = rand() % spacing; i < length; i += 1 + rand() % (2 * spacing)) {
+                payload[i] = SpecialChars[rand() % SpecialChars.length()];
+            }
+        }
+
+        return payload;
+    }
+
+    template <class Fn>
+    double Throughput(std::size_t bytes, int iterations, Fn fn) {
+        auto start = std::chrono::steady_clock::now();
+        for (int i = 0; i < iterations; ++i) {
+            fn();
+        }
+        std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - start;
+
+        return bytes * (double) iterations / elapsed.count() / (1024 * 1024);
+    }
+}
+
+int main(int argc, char* argv[]) {
+    int iterations = argc > 1 ? atoi(argv[1]) : 2000;
+    srand(1);
+
+    std::vector<Escape::Isa> isas = {Escape::Isa::Scalar, Escape::Isa::SSE2, Escape::Isa::AVX2};
+    printf("%-8s %-8s %-6s %-8s %12s %8s %12s %8s\n", "size", "spacing", "isa", "", "encode MB/s", "speedup", "decode MB/s", "speedup");
+
+    for (std::size_t size : {256u, 4096u, 65536u}) {
+        for (std::size_t spacing : {0u, 256u, 16u}) {
+            auto payload = Payload(size, spacing);
+            auto encoded = ReferenceEncode(payload);
+            std::vector<char> out(Escape::MaxEncodedLength(size) + 1);
+
+            volatile std::size_t sink = 0;
+            auto refEncode = Throughput(size, iterations, [&] { sink += ReferenceEncode(payload).length(); });
+            auto refDecode = Throughput(size, iterations, [&] { sink += ReferenceDecode(encoded).length(); });
+            printf("%-8zu %-8zu %-6s %-8s %12.0f %8s %12.0f %8s\n", size, spacing, "ref", "", refEncode, "1.00", refDecode, "1.00");
+
+            for (auto isa : isas) {
+                if (!Escape::Supported(isa)) {
+                    continue;
+                }
+
+                auto kernels = Escape::For(isa);
+                auto length = Escape::Encode(payload.data(), payload.length(), out.data(), kernels);
+                bool ok = std::string(out.data(), length) == encoded;
+                length = Escape::Decode(encoded.data(), encoded.length(), out.data(), kernels);
+                ok = ok && std::string(out.data(), length) == payload;
+
+                auto encode = Throughput(size, iterations, [&] { sink += Escape::Encode(payload.data(), payload.length(), out.data(), kernels); });
+                auto decode = Throughput(size, iterations, [&] { sink += Escape::Decode(encoded.data(), encoded.length(), out.data(), kernels); });
+                printf("%-8zu %-8zu %-6s %-8s %12.0f %8.2f %12.0f %8.2f\n", size, spacing, kernels.name, ok ? "" : "MISMATCH",
+                       encode, encode / refEncode, decode, decode / refDecode);
+            }
+        }
+    }
+
+    return 0;
+}
@@ -0,0 +1,109 @@
+#include <functional>
+#include <list>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <unordered_map>
+
+#ifndef PROJECT_ENDPOINTCACHE_H
+#define PROJECT_ENDPOINTCACHE_H
+
+struct EndpointCacheStats {
+    unsigned long long hits = 0;
+    unsigned long long misses = 0;
+    unsigned long long evictions = 0;
+    unsigned long long invalidations = 0;
+    unsigned int size = 0;
+    unsigned int capacity = 0;
+};
+
+//Bounded LRU of open destinations, keyed by resolved path. Endpoints are
+//handed out as shared_ptrs so an entry can be evicted or invalidated while
+//another thread is still writing through it; the endpoint's destructor
+//releases the underlying handle once the last user lets go.
+template <class Endpoint>
+class EndpointCache {
+    typedef std::shared_ptr<Endpoint> EndpointPtr;
+    typedef std::pair<std::string, EndpointPtr> Entry;
+
+    std::list<Entry> _entries; //Most recently used first
+    std::unordered_map<std::string, typename std::list<Entry>::iterator> _index;
+    std::function<EndpointPtr(const std::string&)> _open;
+    EndpointCacheStats _stats;
+    std::mutex _lock;
+
+    void trim() {
+        while (_entries.size() > _stats.capacity) {
+            _index.erase(_entries.back().first);
+            _entries.pop_back();
+            _stats.evictions++;
+        }
+    }
+
+public:
+    EndpointCache(unsigned int capacity, std::function<EndpointPtr(const std::string&)> open): _open(open) {
+        _stats.capacity = capacity;
+    }
+
+    //Opens the endpoint on a miss. Exceptions from the open procedure are
+    //passed on and nothing is cached.
+    EndpointPtr acquire(const std::string& key) {
+        {
+            std::lock_guard<std::mutex> guard(_lock);
+
+            auto it = _index.find(key);
+            if (it != _index.end()) {
+                _entries.splice(_entries.begin(), _entries, it->second);
+                _stats.hits++;
+                return it->second->second;
+            }
+
+            _stats.misses++;
+        }
+
+        //Don't hold the lock while opening; a racing miss on the same key just
+        //replaces the other's entry
+        auto endpoint = _open(key);
+
+        std::lock_guard<std::mutex> guard(_lock);
+        auto it = _index.find(key);
+        if (it != _index.end()) {
+            _entries.erase(it->second);
+        }
+
+        _entries.emplace_front(key, endpoint);
+        _index[key] = _entries.begin();
+        trim();
+
+        return endpoint;
+    }
+
+    //Drops the entry for 'key' if it still refers to 'endpoint', so a writer
+    //that failed doesn't throw away a replacement opened by another thread
+    void invalidate(const std::string& key, const EndpointPtr& endpoint) {
+        std::lock_guard<std::mutex> guard(_lock);
+
+        auto it = _index.find(key);
+        if (it != _index.end() && it->second->second == endpoint) {
+            _entries.erase(it->second);
+            _index.erase(it);
+            _stats.invalidations++;
+        }
+    }
+
+    void setCapacity(unsigned int capacity) {
+        std::lock_guard<std::mutex> guard(_lock);
+        _stats.capacity = capacity;
+        trim();
+    }
+
+    EndpointCacheStats stats() {
+        std::lock_guard<std::mutex> guard(_lock);
+        auto ret = _stats;
+        ret.size = (unsigned int) _entries.size();
+
+        return ret;
+    }
+};
+
+#endif //PROJECT_ENDPOINTCACHE_H
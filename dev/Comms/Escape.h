@@ -0,0 +1,276 @@
+#include <cstddef>
+#include <cstring>
+
+#if defined(__x86_64__) || defined(_M_X64) || defined(__i386__) || defined(_M_IX86)
+#define SUL_ESCAPE_X86
+#ifdef _MSC_VER
+#include <intrin.h>
+#endif
+#include <emmintrin.h>
+#include <immintrin.h>
+#endif
+
+#ifndef PROJECT_ESCAPE_H
+#define PROJECT_ESCAPE_H
+
+//Message escaping: '&', '=', '|' and '\x01' are written as '|' followed by
+//the character. '\x01' opens transport frames, so escaping it means no text
+//message can be taken for one. Both directions are a scan for the next character that needs
+//attention followed by a bulk copy of the clean run before it, so only the
+//scan is vectorized. The widest kernel the CPU supports is picked on first use.
+namespace Escape {
+    enum class Isa {
+        Scalar,
+        SSE2,
+        AVX2
+    };
+
+    //Each scan returns the first character in [pos, end) that needs escaping
+    //(encode) or is an escape (decode), or 'end' if there is none
+    typedef const char* (*Scan)(const char* pos, const char* end);
+
+    struct Kernels {
+        Isa isa;
+        const char* name;
+        Scan scanEncode;
+        Scan scanDecode;
+    };
+
+    inline bool IsSpecial(char c) {
+        return c == '&' || c == '=' || c == '|' || c == '\x01';
+    }
+
+    inline const char* ScanEncodeScalar(const char* pos, const char* end) {
+        while (pos < end && !IsSpecial(*pos)) {
+            ++pos;
+        }
+
+        return pos;
+    }
+    inline const char* ScanDecodeScalar(const char* pos, const char* end) {
+        auto found = static_cast<const char*>(memchr(pos, '|', end - pos));
+
+        return found ? found : end;
+    }
+
+#ifdef SUL_ESCAPE_X86
+#if defined(__GNUC__) || defined(__clang__)
+#define SUL_TARGET(isa) __attribute__((target(isa)))
+#else
+#define SUL_TARGET(isa)
+#endif
+
+    inline unsigned LowestBit(unsigned mask) {
+#ifdef _MSC_VER
+        unsigned long index;
+        _BitScanForward(&index, mask);
+        return (unsigned) index;
+#else
+        return (unsigned) __builtin_ctz(mask);
+#endif
+    }
+
+    SUL_TARGET("sse2") inline const char* ScanEncodeSSE2(const char* pos, const char* end) {
+        const __m128i amp = _mm_set1_epi8('&'), eq = _mm_set1_epi8('='), bar = _mm_set1_epi8('|'), marker = _mm_set1_epi8('\x01');
+
+        for (; end - pos >= 16; pos += 16) {
+            __m128i block = _mm_loadu_si128(reinterpret_cast<const __m128i*>(pos));
+            __m128i hits = _mm_or_si128(_mm_or_si128(_mm_cmpeq_epi8(block, amp), _mm_cmpeq_epi8(block, eq)),
+                                        _mm_or_si128(_mm_cmpeq_epi8(block, bar), _mm_cmpeq_epi8(block, marker)));
+
+            if (unsigned mask = (unsigned) _mm_movemask_epi8(hits)) {
+                return pos + LowestBit(mask);
+            }
+        }
+
+        return ScanEncodeScalar(pos, end);
+    }
+    SUL_TARGET("sse2") inline const char* ScanDecodeSSE2(const char* pos, const char* end) {
+        const __m128i bar = _mm_set1_epi8('|');
+
+        for (; end - pos >= 16; pos += 16) {
+            __m128i block = _mm_loadu_si128(reinterpret_cast<const __m128i*>(pos));
+
+            if (unsigned mask = (unsigned) _mm_movemask_epi8(_mm_cmpeq_epi8(block, bar))) {
+                return pos + LowestBit(mask);
+            }
+        }
+
+        return ScanDecodeScalar(pos, end);
+    }
+
+    SUL_TARGET("avx2") inline const char* ScanEncodeAVX2(const char* pos, const char* end) {
+        const __m256i amp = _mm256_set1_epi8('&'), eq = _mm256_set1_epi8('='), bar = _mm256_set1_epi8('|'), marker = _mm256_set1_epi8('\x01');
+
+        for (; end - pos >= 32; pos += 32) {
+            __m256i block = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(pos));
+            __m256i hits = _mm256_or_si256(_mm256_or_si256(_mm256_cmpeq_epi8(block, amp), _mm256_cmpeq_epi8(block, eq)),
+                                           _mm256_or_si256(_mm256_cmpeq_epi8(block, bar), _mm256_cmpeq_epi8(block, marker)));
+
+            if (unsigned mask = (unsigned) _mm256_movemask_epi8(hits)) {
+                return pos + LowestBit(mask);
+            }
+        }
+
+        return ScanEncodeSSE2(pos, end);
+    }
+    SUL_TARGET("avx2") inline const char* ScanDecodeAVX2(const char* pos, const char* end) {
+        const __m256i bar = _mm256_set1_epi8('|');
+
+        for (; end - pos >= 32; pos += 32) {
+            __m256i block = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(pos));
+
+            if (unsigned mask = (unsigned) _mm256_movemask_epi8(_mm256_cmpeq_epi8(block, bar))) {
+                return pos + LowestBit(mask);
+            }
+        }
+
+        return ScanDecodeSSE2(pos, end);
+    }
+
+#undef SUL_TARGET
+#endif
+
+    inline bool Supported(Isa isa) {
+        switch (isa) {
+            case Isa::Scalar:
+                return true;
+#ifdef SUL_ESCAPE_X86
+#if defined(__GNUC__) || defined(__clang__)
+            case Isa::SSE2:
+                return __builtin_cpu_supports("sse2") != 0;
+            case Isa::AVX2:
+                return __builtin_cpu_supports("avx2") != 0;
+#elif defined(_MSC_VER)
+            case Isa::SSE2: {
+                int info[4];
+                __cpuid(info, 1);
+                return (info[3] & (1 << 26)) != 0;
+            }
+            case Isa::AVX2: {
+                int info[4];
+                __cpuid(info, 1);
+                if ((info[2] & (1 << 27)) == 0 || (_xgetbv(0) & 6) != 6) { //The OS has to save the YMM registers
+                    return false;
+                }
+
+                __cpuid(info, 0);
+                if (info[0] < 7) {
+                    return false;
+                }
+
+                __cpuidex(info, 7, 0);
+                return (info[1] & (1 << 5)) != 0;
+            }
+#endif
+#endif
+            default:
+                return false;
+        }
+    }
+
+    //Kernels for a specific instruction set. Falls back to scalar if this
+    //build has no kernel for it; check Supported() before running them.
+    inline Kernels For(Isa isa) {
+#ifdef SUL_ESCAPE_X86
+        if (isa == Isa::AVX2) {
+            return Kernels{Isa::AVX2, "avx2", ScanEncodeAVX2, ScanDecodeAVX2};
+        }
+        if (isa == Isa::SSE2) {
+            return Kernels{Isa::SSE2, "sse2", ScanEncodeSSE2, ScanDecodeSSE2};
+        }
+#endif
+
+        return Kernels{Isa::Scalar, "scalar", ScanEncodeScalar, ScanDecodeScalar};
+    }
+
+    inline Kernels const& Best() {
+        static const Kernels best = For(Supported(Isa::AVX2) ? Isa::AVX2 : Supported(Isa::SSE2) ? Isa::SSE2 : Isa::Scalar);
+
+        return best;
+    }
+
+    //Worst case, every character is escaped
+    inline std::size_t MaxEncodedLength(std::size_t length) {
+        return 2 * length;
+    }
+
+    //Exact length of the escaped form of [data, data + length)
+    inline std::size_t EncodedLength(const char* data, std::size_t length, Kernels const& kernels = Best()) {
+        const char* end = data + length;
+        std::size_t specials = 0;
+
+        while ((data = kernels.scanEncode(data, end)) != end) {
+            ++specials;
+            ++data;
+        }
+
+        return length + specials;
+    }
+
+    //Exact length of the unescaped form of [data, data + length)
+    inline std::size_t DecodedLength(const char* data, std::size_t length, Kernels const& kernels = Best()) {
+        const char* end = data + length;
+        std::size_t escapes = 0;
+
+        while ((data = kernels.scanDecode(data, end)) != end) {
+            ++escapes;
+            data += 2;
+            if (data > end) {
+                break;
+            }
+        }
+
+        return length - escapes;
+    }
+
+    //Writes the escaped form of [data, data + length) to 'out', which must hold
+    //MaxEncodedLength(length) characters. Returns the number written.
+    inline std::size_t Encode(const char* data, std::size_t length, char* out, Kernels const& kernels = Best()) {
+        const char* end = data + length;
+        char* written = out;
+
+        while (data < end) {
+            const char* special = kernels.scanEncode(data, end);
+
+            memcpy(written, data, special - data);
+            written += special - data;
+
+            if (special == end) {
+                break;
+            }
+
+            *written++ = '|';
+            *written++ = *special;
+            data = special + 1;
+        }
+
+        return written - out;
+    }
+
+    //Writes the unescaped form of [data, data + length) to 'out', which must
+    //hold 'length' characters. A trailing lone '|' is dropped. Returns the
+    //number written.
+    inline std::size_t Decode(const char* data, std::size_t length, char* out, Kernels const& kernels = Best()) {
+        const char* end = data + length;
+        char* written = out;
+
+        while (data < end) {
+            const char* escape = kernels.scanDecode(data, end);
+
+            memcpy(written, data, escape - data);
+            written += escape - data;
+
+            if (end - escape < 2) {
+                break;
+            }
+
+            *written++ = escape[1];
+            data = escape + 2;
+        }
+
+        return written - out;
+    }
+}
+
+#endif //PROJECT_ESCAPE_H
@@ -1,6 +1,10 @@
 #include <windows.h>
+#include <map>
+#include <memory>
+#include <mutex>
 #include <string>
 #include <stdexcept>
+#include "EndpointCache.h"
 
 using std::string;
 using std::runtime_error;
@@ -53,26 +57,189 @@ HANDLE WINAPI CreateSlotAndGetFile(LPTSTR slotName) {
     CreateSlot(slotName);
     return GetFile(slotName);
 }
-BOOL WINAPI Write(LPTSTR slotName, LPTSTR lpszMessage) {
+//Destination handle held open by the endpoint cache
+struct SlotFile {
+    HANDLE hFile;
+
+    SlotFile(HANDLE file): hFile(file) {}
+    ~SlotFile() {
+        CloseHandle(hFile);
+    }
+};
+
+EndpointCache<SlotFile>& Destinations() {
+    static EndpointCache<SlotFile> cache(64, [](const string& slotName) {
+        return std::make_shared<SlotFile>(GetFile(slotName));
+    });
+
+    return cache;
+}
+
+//A failed write drops the cached handle and is retried once on a fresh one,
+//which covers mailslots that were closed and recreated under the same name.
+//A null is always appended, which Read and DrainMessages strip off again.
+BOOL WINAPI WriteData(string slotName, const char* data, DWORD length) {
     BOOL fResult;
     DWORD cbWritten;
-    HANDLE mailSlot = GetFile(slotName);
+    string message(data, length);
+    message += '\0';
+
+    for (int attempt = 0; ; ++attempt) {
+        auto mailSlot = Destinations().acquire(slotName);
 
-    if (mailSlot) {
-        fResult = WriteFile(mailSlot,
-                            lpszMessage,
-                            (DWORD) (lstrlen(lpszMessage) + 1) * sizeof(TCHAR),
+        fResult = WriteFile(mailSlot->hFile,
+                            message.data(),
+                            (DWORD) message.length(),
                             &cbWritten,
                             (LPOVERLAPPED) NULL);
 
-        if (!fResult) {
-            throw std::runtime_error("[" + std::to_string(GetLastError()) + "] Mail::Write - WriteFile returned nullable value.");
+        if (fResult) {
+            return TRUE;
+        }
+
+        auto err = GetLastError();
+        Destinations().invalidate(slotName, mailSlot);
+
+        if (attempt > 0) {
+            throw std::runtime_error("[" + std::to_string(err) + "] Mail::Write - WriteFile returned nullable value.");
+        }
+    }
+}
+BOOL WINAPI Write(LPTSTR slotName, LPTSTR lpszMessage) {
+    return WriteData(slotName, lpszMessage, (DWORD) lstrlen(lpszMessage));
+}
+//Mailslot handles can't be waited on for readability, so waits re-check the
+//slot, 1 ms after the last check at first and backing off to every
+//MaxSlotPoll ms while it stays empty. Each slot gets an event that WakeSlot
+//sets to cut a wait short.
+const DWORD MaxSlotPoll = 20;
+
+std::map<HANDLE, HANDLE> wakeEvents;
+std::mutex wakeEventsLock;
+
+HANDLE WINAPI WakeEvent(HANDLE hSlot) {
+    std::lock_guard<std::mutex> guard(wakeEventsLock);
+    auto& hEvent = wakeEvents[hSlot];
+
+    if (!hEvent) {
+        hEvent = CreateEvent(NULL, FALSE, FALSE, NULL);
+
+        if (NULL == hEvent) {
+            wakeEvents.erase(hSlot);
+            throw (unsigned int) GetLastError();
+        }
+    }
+
+    return hEvent;
+}
+void WINAPI CloseSlot(HANDLE hSlot) {
+    {
+        std::lock_guard<std::mutex> guard(wakeEventsLock);
+        auto it = wakeEvents.find(hSlot);
+
+        if (it != wakeEvents.end()) {
+            CloseHandle(it->second);
+            wakeEvents.erase(it);
+        }
+    }
+
+    CloseHandle(hSlot);
+}
+DWORD WINAPI WaitForMessages(HANDLE hSlot, DWORD timeout) {
+    HANDLE hEvent = WakeEvent(hSlot);
+    DWORD start = GetTickCount();
+    DWORD poll = 1;
+    DWORD cMessage;
+
+    while (true) {
+        if (!GetMailslotInfo(hSlot, NULL, NULL, &cMessage, NULL)) {
+            throw (unsigned int) GetLastError();
+        }
+
+        DWORD elapsed = GetTickCount() - start;
+        if (cMessage > 0 || (timeout > 0 && elapsed >= timeout)) {
+            return cMessage;
         }
 
-        return TRUE;
+        DWORD wait = timeout > 0 && timeout - elapsed < poll ? timeout - elapsed : poll;
+        if (WaitForSingleObject(hEvent, wait) == WAIT_OBJECT_0) {
+            return 0; //Woken
+        }
+
+        poll = poll * 2 < MaxSlotPoll ? poll * 2 : MaxSlotPoll;
+    }
+}
+void WINAPI WakeSlot(HANDLE hSlot) {
+    SetEvent(WakeEvent(hSlot));
+}
+//Copies up to 'max' messages into 'out' as [uint32 length][bytes] records,
+//reading each straight into place. Returns the number copied. If the first
+//message doesn't fit, returns 0 and sets 'used' to the buffer size it needs.
+unsigned int WINAPI DrainMessages(HANDLE hSlot, unsigned int max, char* out, std::size_t capacity, std::size_t& used) {
+    DWORD cbMessage, cMessage, cbRead;
+    unsigned int count = 0;
+    used = 0;
+
+    while (count < max) {
+        if (!GetMailslotInfo(hSlot, (LPDWORD) NULL, &cbMessage, &cMessage, (LPDWORD) NULL)) {
+            throw (unsigned int) GetLastError();
+        }
+
+        if (cMessage == 0 || cbMessage == MAILSLOT_NO_MESSAGE) {
+            break;
+        }
+
+        if (used + sizeof(DWORD) + cbMessage > capacity) {
+            if (count == 0) {
+                used = sizeof(DWORD) + cbMessage;
+            }
+            break;
+        }
+
+        if (!ReadFile(hSlot, out + used + sizeof(DWORD), cbMessage, &cbRead, (LPOVERLAPPED) NULL)) {
+            throw (unsigned int) GetLastError();
+        }
+
+        //Writers include the terminating null
+        if (cbRead > 0) {
+            cbRead--;
+        }
+
+        memcpy(out + used, &cbRead, sizeof(DWORD));
+        used += sizeof(DWORD) + cbRead;
+        count++;
+    }
+
+    return count;
+}
+//Reads the next message into 'out' if it fits, null terminated as the
+//writer sent it. Returns the space needed, or 0 if nothing is waiting. A
+//message that doesn't fit stays in the mailslot.
+DWORD WINAPI ReadInto(HANDLE hSlot, char* out, std::size_t capacity) {
+    DWORD cbMessage, cMessage, cbRead;
+
+    if (!GetMailslotInfo(hSlot, (LPDWORD) NULL, &cbMessage, &cMessage, (LPDWORD) NULL)) {
+        throw (unsigned int) GetLastError();
+    }
+
+    if (cMessage == 0 || cbMessage == MAILSLOT_NO_MESSAGE) {
+        return 0;
+    }
+
+    if (cbMessage > capacity) {
+        return cbMessage;
+    }
+
+    if (!ReadFile(hSlot, out, cbMessage, &cbRead, (LPOVERLAPPED) NULL)) {
+        throw (unsigned int) GetLastError();
+    }
+
+    //Writers include the terminating null
+    if (cbRead > 0) {
+        out[cbRead - 1] = 0;
     }
 
-    throw std::runtime_error("[" + std::to_string(GetLastError()) + "] Mail::Write - 'mailSlot' is not a valid handle.");
+    return cbRead;
 }
 string WINAPI Read(HANDLE hSlot) {
     DWORD cbMessage, cMessage, cbRead;
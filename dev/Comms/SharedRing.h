@@ -0,0 +1,339 @@
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <sched.h>
+#include <signal.h>
+#include <unistd.h>
+#include <atomic>
+#include <cerrno>
+#include <chrono>
+#include <cstdint>
+#include <cstring>
+#include <new>
+#include <string>
+#include <stdexcept>
+
+#ifndef PROJECT_SHAREDRING_H
+#define PROJECT_SHAREDRING_H
+
+#if ATOMIC_LLONG_LOCK_FREE != 2 || ATOMIC_INT_LOCK_FREE != 2
+#error "SharedRing requires lock-free 32 and 64 bit atomics"
+#endif
+
+//Multi-producer, single-consumer byte ring living in POSIX shared memory.
+//The owning node creates it next to its socket; any process on the host can
+//map it and append records without going through the kernel.
+//
+//Producers reserve space by advancing 'tail' with a CAS, mark the record
+//reserved with their process ID, copy their payload and then flip the record
+//state to published. The consumer walks from 'head', zeroes what it has read
+//and hands the space back by advancing 'head'. A record whose producer died
+//before publishing it is skipped once the consumer has waited on it a while.
+//
+//A consumer about to block raises 'waiting' and checks the ring once more;
+//the producer that takes the flag down owes it a doorbell on the socket.
+class SharedRing {
+    static const uint32_t Magic = 0x53554c52; //"SULR"
+
+    enum RecordState: uint32_t {
+        Empty = 0,
+        Published = 1,
+        Padding = 2,
+        Reserved = 3 //Low bits only; the rest hold the producer's process ID
+    };
+
+    //How long the consumer waits on an unpublished record before checking
+    //whether its producer is still alive
+    static const int AbandonAfterMs = 1000;
+
+    struct Record {
+        std::atomic<uint32_t> state;
+        uint32_t length;
+    };
+
+    struct Header {
+        std::atomic<uint32_t> magic;
+        std::atomic<uint32_t> closed;
+        uint64_t capacity;
+
+        alignas(64) std::atomic<uint64_t> tail;
+        std::atomic<uint64_t> published;
+
+        alignas(64) std::atomic<uint64_t> head;
+        std::atomic<uint64_t> consumed;
+        std::atomic<uint32_t> waiting;
+    };
+
+    std::string _name;
+    Header* _header = nullptr;
+    char* _data = nullptr;
+    std::size_t _mapped = 0;
+    bool _owner = false;
+    bool _abandoned = false; //Set by the consumer if a producer died without marking its record
+
+    SharedRing() {}
+
+    static std::size_t Align(std::size_t n) {
+        return (n + 7) & ~static_cast<std::size_t>(7);
+    }
+
+    Record* recordAt(uint64_t pos) {
+        return reinterpret_cast<Record*>(_data + pos % _header->capacity);
+    }
+
+    static bool ProcessAlive(uint32_t pid) {
+        return kill(static_cast<pid_t>(pid), 0) == 0 || errno == EPERM;
+    }
+
+    static SharedRing* Map(std::string name, int fd, std::size_t size, bool owner) {
+        void* mem = mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+        close(fd);
+
+        if (mem == MAP_FAILED) {
+            if (owner) {
+                shm_unlink(name.c_str());
+            }
+            throw std::runtime_error("[" + std::to_string(errno) + "] SharedRing::Map - mmap failed for " + name);
+        }
+
+        auto ring = new SharedRing;
+        ring->_name = name;
+        ring->_header = static_cast<Header*>(mem);
+        ring->_data = static_cast<char*>(mem) + Align(sizeof(Header));
+        ring->_mapped = size;
+        ring->_owner = owner;
+
+        return ring;
+    }
+
+public:
+    ~SharedRing() {
+        if (_owner) {
+            _header->closed.store(1);
+            shm_unlink(_name.c_str());
+        }
+
+        munmap(_header, _mapped);
+    }
+
+    //Builds a shared memory object name from a resolved socket path
+    static std::string NameFor(std::string path) {
+        for (auto& c : path) {
+            if (c == '/') {
+                c = '.';
+            }
+        }
+
+        return "/sul" + path;
+    }
+
+    static SharedRing* Create(std::string name, std::size_t capacity) {
+        capacity = Align(capacity);
+        std::size_t size = Align(sizeof(Header)) + capacity;
+
+        shm_unlink(name.c_str()); //Stale ring from a node that wasn't closed
+        int fd = shm_open(name.c_str(), O_RDWR | O_CREAT | O_EXCL, 0666);
+
+        if (fd == -1) {
+            throw std::runtime_error("[" + std::to_string(errno) + "] SharedRing::Create - shm_open failed for " + name);
+        }
+        if (ftruncate(fd, (off_t) size) == -1) {
+            close(fd);
+            shm_unlink(name.c_str());
+            throw std::runtime_error("[" + std::to_string(errno) + "] SharedRing::Create - ftruncate failed for " + name);
+        }
+
+        auto ring = Map(name, fd, size, true);
+        auto header = new (ring->_header) Header; //Fresh pages are already zeroed
+
+        header->capacity = capacity;
+        header->magic.store(Magic); //Producers ignore the ring until this is set
+
+        return ring;
+    }
+
+    //Returns nullptr if the node has no (usable) ring
+    static SharedRing* Attach(std::string name) {
+        int fd = shm_open(name.c_str(), O_RDWR, 0);
+        if (fd == -1) {
+            return nullptr;
+        }
+
+        struct stat st;
+        if (fstat(fd, &st) == -1 || (std::size_t) st.st_size < Align(sizeof(Header))) {
+            close(fd);
+            return nullptr;
+        }
+
+        auto ring = Map(name, fd, (std::size_t) st.st_size, false);
+        if (ring->_header->magic.load() != Magic || ring->_header->closed.load() ||
+                Align(sizeof(Header)) + ring->_header->capacity > ring->_mapped) {
+            delete ring;
+            return nullptr;
+        }
+
+        return ring;
+    }
+
+    bool isClosed() const {
+        return _header->closed.load(std::memory_order_acquire) != 0;
+    }
+
+    //Records over half the ring always go through the socket
+    bool fits(std::size_t length) const {
+        return length <= UINT32_MAX && Align(sizeof(Record) + length) <= _header->capacity / 2;
+    }
+
+    //Returns false if the record can't be placed, either because it doesn't
+    //fit or because the consumer hasn't freed enough space yet
+    bool write(const char* data, std::size_t length) {
+        uint64_t capacity = _header->capacity;
+        uint64_t need = Align(sizeof(Record) + length);
+
+        if (!fits(length)) {
+            return false;
+        }
+
+        uint64_t pos = _header->tail.load(std::memory_order_relaxed);
+        uint64_t pad;
+        do {
+            uint64_t offset = pos % capacity;
+            pad = offset + need > capacity ? capacity - offset : 0;
+
+            if (pos + pad + need - _header->head.load(std::memory_order_acquire) > capacity) {
+                return false;
+            }
+        } while (!_header->tail.compare_exchange_weak(pos, pos + pad + need, std::memory_order_acq_rel));
+
+        if (pad) {
+            //Skip the space at the end of the ring so the record stays contiguous
+            auto filler = recordAt(pos);
+            filler->length = static_cast<uint32_t>(pad - sizeof(Record));
+            filler->state.store(Padding, std::memory_order_release);
+            pos += pad;
+        }
+
+        auto record = recordAt(pos);
+        record->length = static_cast<uint32_t>(length);
+        record->state.store(Reserved | (static_cast<uint32_t>(getpid()) << 2), std::memory_order_release);
+        memcpy(reinterpret_cast<char*>(record) + sizeof(Record), data, length);
+        record->state.store(Published, std::memory_order_release);
+
+        _header->published.fetch_add(1);
+
+        return true;
+    }
+
+    //Set by the consumer around a blocking wait
+    void setWaiting(bool waiting) {
+        _header->waiting.store(waiting ? 1 : 0);
+    }
+
+    //True for the first producer to see the consumer waiting since it last set
+    //the flag. Must only be called after a successful write().
+    bool takeWaiter() {
+        return _header->waiting.load() != 0 && _header->waiting.exchange(0) != 0;
+    }
+
+    //Number of records published but not yet read
+    unsigned int count() const {
+        if (_abandoned) {
+            return 0;
+        }
+
+        return static_cast<unsigned int>(_header->published.load() - _header->consumed.load(std::memory_order_relaxed));
+    }
+
+    //Oldest unread payload, or nullptr if the ring is empty. Only called by
+    //the owner; the record stays in place until pop().
+    const char* front(std::size_t& length) {
+        if (count() == 0) {
+            return nullptr;
+        }
+
+        uint64_t head = _header->head.load(std::memory_order_relaxed);
+        auto start = std::chrono::steady_clock::now();
+        unsigned int spins = 0;
+
+        while (true) {
+            auto record = recordAt(head);
+            auto state = record->state.load(std::memory_order_acquire);
+
+            if (state == Published) {
+                length = record->length;
+                return reinterpret_cast<char*>(record) + sizeof(Record);
+            }
+
+            if (state == Padding) {
+                release(record);
+                head = _header->head.load(std::memory_order_relaxed);
+                continue;
+            }
+
+            //Counted, but the producer that owns the oldest slot is still
+            //copying. Yield at first, then sleep, so a stalled producer
+            //doesn't cost a core.
+            if (++spins < 64) {
+                sched_yield();
+                continue;
+            }
+
+            if (std::chrono::duration_cast<std::chrono::milliseconds>(std::chrono::steady_clock::now() - start).count() < AbandonAfterMs) {
+                usleep(1000);
+                continue;
+            }
+
+            if ((state & 3) == Reserved) {
+                if (!ProcessAlive(state >> 2)) {
+                    release(record); //Never published, so never counted
+                    head = _header->head.load(std::memory_order_relaxed);
+                }
+
+                start = std::chrono::steady_clock::now();
+                continue;
+            }
+
+            //A producer died between reserving space and marking it, so the
+            //record's length is unknown and nothing past it can be found.
+            //Closing the ring sends producers back to the socket.
+            _abandoned = true;
+            _header->closed.store(1);
+
+            return nullptr;
+        }
+    }
+
+    //Discards the record returned by front()
+    void pop() {
+        release(recordAt(_header->head.load(std::memory_order_relaxed)));
+        _header->consumed.fetch_add(1, std::memory_order_relaxed);
+    }
+
+    bool read(std::string& out) {
+        std::size_t length;
+        auto data = front(length);
+
+        if (!data) {
+            return false;
+        }
+
+        out.assign(data, length);
+        pop();
+
+        return true;
+    }
+
+private:
+    //Zero the span so stale bytes are never mistaken for a record header,
+    //then hand it back to the producers
+    void release(Record* record) {
+        auto size = Align(sizeof(Record) + record->length);
+
+        memset(reinterpret_cast<char*>(record) + sizeof(Record), 0, size - sizeof(Record));
+        record->length = 0;
+        record->state.store(Empty, std::memory_order_relaxed);
+        _header->head.fetch_add(size, std::memory_order_release);
+    }
+};
+
+#endif //PROJECT_SHAREDRING_H
@@ -0,0 +1,142 @@
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <cstring>
+#include <functional>
+#include <random>
+#include <thread>
+
+#ifdef _WIN32
+#include <windows.h>
+#else
+#include <unistd.h>
+#endif
+
+#ifndef PROJECT_UID_H
+#define PROJECT_UID_H
+
+//Message UIDs come from a xoshiro256** generator kept per thread, so no
+//locking is needed and threads never share a sequence. Each generator is
+//seeded from the OS entropy source mixed with the process ID, the clock, the
+//thread and a process-wide counter, so processes started together on one or
+//many hosts still diverge.
+namespace UID {
+    class Generator {
+        uint64_t _state[4];
+
+        static uint64_t Rotate(uint64_t x, int k) {
+            return (x << k) | (x >> (64 - k));
+        }
+
+        //Spreads one seed word over the state, as recommended for xoshiro
+        static uint64_t SplitMix(uint64_t& x) {
+            uint64_t z = (x += 0x9e3779b97f4a7c15ULL);
+            z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ULL;
+            z = (z ^ (z >> 27)) * 0x94d049bb133111ebULL;
+
+            return z ^ (z >> 31);
+        }
+
+        static uint64_t Entropy() {
+            try {
+                std::random_device device;
+                return (static_cast<uint64_t>(device()) << 32) ^ device();
+            } catch (...) {
+                return 0; //No entropy source; the other inputs still differ per process
+            }
+        }
+
+    public:
+        Generator() {
+            static std::atomic<uint64_t> created(0);
+
+#ifdef _WIN32
+            uint64_t pid = GetCurrentProcessId();
+#else
+            uint64_t pid = static_cast<uint64_t>(getpid());
+#endif
+            uint64_t inputs[] = {
+                Entropy(),
+                pid,
+                static_cast<uint64_t>(std::chrono::high_resolution_clock::now().time_since_epoch().count()),
+                static_cast<uint64_t>(std::hash<std::thread::id>()(std::this_thread::get_id())),
+                static_cast<uint64_t>(reinterpret_cast<uintptr_t>(this)),
+                created.fetch_add(1)
+            };
+
+            uint64_t seed = 0;
+            for (auto input : inputs) {
+                seed = SplitMix(seed) ^ input;
+            }
+            for (auto& word : _state) {
+                word = SplitMix(seed);
+            }
+        }
+
+        uint64_t next() {
+            uint64_t result = Rotate(_state[1] * 5, 7) * 9;
+            uint64_t t = _state[1] << 17;
+
+            _state[2] ^= _state[0];
+            _state[3] ^= _state[1];
+            _state[1] ^= _state[2];
+            _state[0] ^= _state[3];
+            _state[2] ^= t;
+            _state[3] = Rotate(_state[3], 45);
+
+            return result;
+        }
+    };
+
+    inline Generator& ThreadGenerator() {
+        static thread_local Generator generator;
+
+        return generator;
+    }
+
+    //Length of the text form, null included: 8 hex digits plus a separator
+    //(or the null) per segment
+    inline std::size_t TextLength(unsigned int segments) {
+        return segments ? segments * 9 : 1;
+    }
+
+    //Writes 'segments' groups of 8 upper case hex digits separated by '-' and
+    //a null; 'out' must hold TextLength(segments) characters
+    inline void WriteText(unsigned int segments, char* out) {
+        static const char digits[] = "0123456789ABCDEF";
+        auto& generator = ThreadGenerator();
+        uint64_t bits = 0;
+
+        for (unsigned int i = 0; i < segments; ++i) {
+            if (i % 2 == 0) {
+                bits = generator.next();
+            }
+
+            auto segment = static_cast<uint32_t>(bits >> (i % 2 ? 0 : 32));
+            for (int j = 7; j >= 0; --j) {
+                out[j] = digits[segment & 0xf];
+                segment >>= 4;
+            }
+
+            out[8] = '-';
+            out += 9;
+        }
+
+        *(segments ? out - 1 : out) = 0;
+    }
+
+    inline void WriteBinary(unsigned char* out, std::size_t length) {
+        auto& generator = ThreadGenerator();
+
+        while (length > 0) {
+            uint64_t bits = generator.next();
+            auto chunk = length < sizeof(bits) ? length : sizeof(bits);
+
+            memcpy(out, &bits, chunk);
+            out += chunk;
+            length -= chunk;
+        }
+    }
+}
+
+#endif //PROJECT_UID_H
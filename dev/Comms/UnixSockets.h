@@ -0,0 +1,595 @@
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <unistd.h>
+#include <fcntl.h>
+#ifdef __linux__
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/ioctl.h>
+#include <linux/sockios.h>
+#else
+#include <poll.h>
+#endif
+#include <atomic>
+#include <cerrno>
+#include <cstdlib>
+#include <cstring>
+#include <deque>
+#include <chrono>
+#include <memory>
+#include <string>
+#include <vector>
+#include <stdexcept>
+#include "EndpointCache.h"
+#include "SharedRing.h"
+
+using std::string;
+using std::runtime_error;
+
+#ifndef PROJECT_UNIXSOCKETS_H
+#define PROJECT_UNIXSOCKETS_H
+
+//POSIX counterpart to MailSlots.h. Each node owns a Unix-domain datagram
+//socket bound inside the slot directory; the mailslot names handed over by
+//Comms.h are mapped onto paths in that directory.
+//
+//Local ("\\.\mailslot\...") traffic goes through the node's SharedRing when
+//it has one. The socket takes everything else: remote names, records too
+//large for the ring and, once a write finds the ring still full after a few
+//yields, everything for that receiver until it has caught up.
+//
+//Blocking waits sleep in epoll on the socket and a wake-up eventfd (poll and
+//a pipe elsewhere). Ring writers ring a doorbell, an empty datagram, when
+//the receiver has said it is about to sleep.
+
+//Largest datagram a node will send, comfortably inside the default
+//net.core.wmem_max. Receive buffers are sized to match.
+const std::size_t MaxDatagram = 200 * 1024;
+
+struct Slot {
+    int fd = -1;
+    string path;
+    SharedRing* ring = nullptr;
+    unsigned int polls = 0;
+    std::deque<string> pending; //Datagrams already pulled off the socket
+    std::vector<char> buffer; //Receive buffer, allocated on first use
+
+#ifdef __linux__
+    int epfd = -1;
+    int wakefd = -1;
+#else
+    int wakefds[2] = {-1, -1};
+#endif
+};
+
+string SocketError(string where) {
+    return "[" + std::to_string(errno) + "] " + where;
+}
+
+string SlotDirectory() {
+    static string dir;
+
+    if (dir.empty()) {
+        const char* env = getenv("SUL_SLOT_DIR");
+        dir = env && *env ? env : "/tmp/sul-mailslots";
+
+        if (mkdir(dir.c_str(), 0777) == -1 && errno != EEXIST) {
+            throw runtime_error(SocketError("Mail::SlotDirectory - mkdir failed for " + dir));
+        }
+    }
+
+    return dir;
+}
+
+//"\\.\mailslot\a\b", "\\*\mailslot\a\b" and "a\b" all resolve to "<dir>/a.b".
+//There is no domain broadcast for Unix sockets, so remote names land on this host.
+string ResolvePath(string slotName) {
+    auto pos = slotName.find("\\mailslot\\");
+    if (slotName.compare(0, 2, "\\\\") == 0 && pos != string::npos) {
+        slotName = slotName.substr(pos + 10);
+    }
+
+    for (auto& c : slotName) {
+        if (c == '\\' || c == '/') {
+            c = '.';
+        }
+    }
+
+    return SlotDirectory() + "/" + slotName;
+}
+
+bool IsLocalName(const string& slotName) {
+    return slotName.compare(0, 2, "\\\\") != 0 || slotName.compare(0, 4, "\\\\.\\") == 0;
+}
+
+//Ring size for nodes created by this process. SUL_RING_BYTES=0 disables it.
+std::size_t RingCapacity() {
+    const char* env = getenv("SUL_RING_BYTES");
+    return env && *env ? (std::size_t) strtoull(env, nullptr, 10) : 1 << 20;
+}
+
+sockaddr_un SlotAddress(const string& path) {
+    sockaddr_un addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+
+    if (path.length() >= sizeof(addr.sun_path)) {
+        throw runtime_error("Mail::SlotAddress - slot path is too long: " + path);
+    }
+
+    memcpy(addr.sun_path, path.c_str(), path.length());
+    return addr;
+}
+
+//A socket file can outlive its process; only treat the slot as existing if
+//something is still bound to it
+bool SlotExists(string slotName) {
+    auto addr = SlotAddress(ResolvePath(slotName));
+    int fd = socket(AF_UNIX, SOCK_DGRAM, 0);
+
+    if (fd == -1) {
+        throw runtime_error(SocketError("Mail::SlotExists - socket failed"));
+    }
+
+    bool exists = connect(fd, (sockaddr*) &addr, sizeof(addr)) == 0;
+    close(fd);
+
+    return exists;
+}
+
+void CreateWaitHandles(Slot* slot) {
+#ifdef __linux__
+    slot->wakefd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    slot->epfd = epoll_create1(EPOLL_CLOEXEC);
+
+    if (slot->wakefd == -1 || slot->epfd == -1) {
+        throw runtime_error(SocketError("Mail::CreateWaitHandles - eventfd/epoll_create1 failed"));
+    }
+
+    epoll_event ev;
+    memset(&ev, 0, sizeof(ev));
+    ev.events = EPOLLIN;
+
+    ev.data.fd = slot->fd;
+    if (epoll_ctl(slot->epfd, EPOLL_CTL_ADD, slot->fd, &ev) == -1) {
+        throw runtime_error(SocketError("Mail::CreateWaitHandles - epoll_ctl failed"));
+    }
+
+    ev.data.fd = slot->wakefd;
+    if (epoll_ctl(slot->epfd, EPOLL_CTL_ADD, slot->wakefd, &ev) == -1) {
+        throw runtime_error(SocketError("Mail::CreateWaitHandles - epoll_ctl failed"));
+    }
+#else
+    if (pipe(slot->wakefds) == -1 || fcntl(slot->wakefds[0], F_SETFL, O_NONBLOCK) == -1 ||
+            fcntl(slot->wakefds[1], F_SETFL, O_NONBLOCK) == -1) {
+        throw runtime_error(SocketError("Mail::CreateWaitHandles - pipe failed"));
+    }
+#endif
+}
+
+void CloseWaitHandles(Slot* slot) {
+#ifdef __linux__
+    if (slot->epfd != -1) {
+        close(slot->epfd);
+    }
+    if (slot->wakefd != -1) {
+        close(slot->wakefd);
+    }
+#else
+    for (int fd : slot->wakefds) {
+        if (fd != -1) {
+            close(fd);
+        }
+    }
+#endif
+}
+
+Slot* CreateSlot(string slotName) {
+    auto slot = new Slot;
+    slot->path = ResolvePath(slotName);
+    auto addr = SlotAddress(slot->path);
+
+    slot->fd = socket(AF_UNIX, SOCK_DGRAM, 0);
+    if (slot->fd == -1) {
+        delete slot;
+        throw runtime_error(SocketError("Mail::CreateSlot - socket failed"));
+    }
+
+    int res = bind(slot->fd, (sockaddr*) &addr, sizeof(addr));
+    if (res == -1 && errno == EADDRINUSE && !SlotExists(slotName)) {
+        //Left behind by a process that didn't close its node
+        unlink(slot->path.c_str());
+        res = bind(slot->fd, (sockaddr*) &addr, sizeof(addr));
+    }
+
+    if (res == -1 || fcntl(slot->fd, F_SETFL, O_NONBLOCK) == -1) {
+        auto err = SocketError("Mail::CreateSlot - bind failed for " + slot->path);
+        close(slot->fd);
+        delete slot;
+        throw runtime_error(err);
+    }
+
+    try {
+        CreateWaitHandles(slot);
+
+        auto capacity = RingCapacity();
+        if (capacity > 0) {
+            slot->ring = SharedRing::Create(SharedRing::NameFor(slot->path), capacity);
+        }
+    } catch (...) {
+        CloseWaitHandles(slot);
+        close(slot->fd);
+        unlink(slot->path.c_str());
+        delete slot;
+        throw;
+    }
+
+    return slot;
+}
+
+void CloseSlot(Slot* slot) {
+    delete slot->ring;
+    CloseWaitHandles(slot);
+    close(slot->fd);
+    unlink(slot->path.c_str());
+    delete slot;
+}
+
+//An open route to another node: a socket connected to its path, plus a
+//mapping of its ring if it has one
+struct Destination {
+    int fd = -1;
+    SharedRing* ring = nullptr;
+    std::atomic<bool> overflowed{false}; //Writing through the socket until the receiver catches up
+
+    ~Destination() {
+        delete ring;
+
+        if (fd != -1) {
+            close(fd);
+        }
+    }
+};
+
+std::shared_ptr<Destination> OpenDestination(const string& path) {
+    auto addr = SlotAddress(path);
+    auto dest = std::make_shared<Destination>();
+
+    dest->fd = socket(AF_UNIX, SOCK_DGRAM, 0);
+    if (dest->fd == -1) {
+        throw runtime_error(SocketError("Mail::OpenDestination - socket failed"));
+    }
+    if (connect(dest->fd, (sockaddr*) &addr, sizeof(addr)) == -1) {
+        throw runtime_error(SocketError("Mail::OpenDestination - connect failed for " + path));
+    }
+
+    dest->ring = SharedRing::Attach(SharedRing::NameFor(path));
+
+    return dest;
+}
+
+EndpointCache<Destination>& Destinations() {
+    static EndpointCache<Destination> cache(64, OpenDestination);
+    return cache;
+}
+
+//Bytes sent on 'fd' that the receiver hasn't read yet. Only Linux reports
+//this for Unix-domain sockets; elsewhere it is taken to be none.
+std::size_t Unread(int fd) {
+#ifdef __linux__
+    int queued = 0;
+    if (ioctl(fd, SIOCOUTQ, &queued) == 0 && queued > 0) {
+        return (std::size_t) queued;
+    }
+#endif
+    return 0;
+}
+
+//Gives a full ring a few yields to drain. Past that the receiver is taken to
+//be behind, and writes go through the socket until it has read both the ring
+//and what was sent on the socket, so no message overtakes an earlier one.
+//Returns false if the message should go through the socket.
+bool WriteRing(Destination& dest, const char* message, std::size_t length) {
+    if (dest.overflowed.load(std::memory_order_relaxed)) {
+        if (dest.ring->count() > 0 || Unread(dest.fd) > 0) {
+            return false;
+        }
+
+        dest.overflowed.store(false, std::memory_order_relaxed);
+    }
+
+    for (unsigned int attempt = 0; attempt < 64 && !dest.ring->isClosed(); ++attempt) {
+        if (dest.ring->write(message, length)) {
+            return true;
+        }
+
+        sched_yield();
+    }
+
+    dest.overflowed.store(true, std::memory_order_relaxed);
+    return false;
+}
+
+//A failed write drops the cached destination and is retried once on a fresh
+//one, which covers receivers that were closed and recreated under the same name
+bool Write(string slotName, const char* message, std::size_t length) {
+    auto path = ResolvePath(slotName);
+    bool local = IsLocalName(slotName);
+
+    if (length > MaxDatagram) {
+        throw runtime_error("Mail::Write - message of " + std::to_string(length) + " bytes is too large to send to " + slotName);
+    }
+
+    for (int attempt = 0; ; ++attempt) {
+        auto dest = Destinations().acquire(path);
+
+        if (local && dest->ring && dest->ring->fits(length)) {
+            if (WriteRing(*dest, message, length)) {
+                if (dest->ring->takeWaiter()) {
+                    send(dest->fd, "", 0, MSG_DONTWAIT); //Doorbell
+                }
+
+                return true;
+            }
+
+            if (dest->ring->isClosed() && attempt == 0) {
+                Destinations().invalidate(path, dest);
+                continue;
+            }
+        }
+
+        if (send(dest->fd, message, length, 0) != -1) {
+            return true;
+        }
+
+        auto err = SocketError("Mail::Write - send failed for " + slotName);
+        Destinations().invalidate(path, dest);
+
+        if (attempt > 0) {
+            throw runtime_error(err);
+        }
+    }
+}
+
+//Receives one datagram into 'slot->buffer'. Returns false once the socket
+//is drained.
+bool ReceiveDatagram(Slot* slot, std::size_t& length) {
+    if (slot->buffer.empty()) {
+        slot->buffer.resize(MaxDatagram);
+    }
+
+    while (true) {
+        auto size = recv(slot->fd, &slot->buffer[0], slot->buffer.size(), 0);
+
+        if (size == -1) {
+            if (errno == EAGAIN || errno == EWOULDBLOCK) {
+                return false;
+            }
+            if (errno == EINTR) {
+                continue;
+            }
+
+            throw runtime_error(SocketError("Mail::ReceiveDatagram - recv failed"));
+        }
+
+        if (size > 0) { //Empty datagrams are ring doorbells
+            length = (std::size_t) size;
+            return true;
+        }
+    }
+}
+
+//Moves everything queued on the socket into 'slot->pending'
+unsigned int PullPending(Slot* slot) {
+    std::size_t length;
+
+    while (ReceiveDatagram(slot, length)) {
+        slot->pending.push_back(string(&slot->buffer[0], length));
+    }
+
+    return (unsigned int) slot->pending.size();
+}
+
+//Only polls the socket when the ring is empty, or every 64th call so socket
+//traffic isn't starved, so a busy ring is counted without a syscall
+unsigned int CountMessages(Slot* slot) {
+    unsigned int queued = slot->ring ? slot->ring->count() : 0;
+
+    if (queued == 0 || ++slot->polls % 64 == 0) {
+        PullPending(slot);
+    }
+
+    return queued + (unsigned int) slot->pending.size();
+}
+
+//Blocks until there is something to read, 'timeout' ms pass (0 waits
+//indefinitely) or WakeSlot is called. Returns the number of messages waiting.
+unsigned int WaitForMessages(Slot* slot, unsigned int timeout) {
+    auto deadline = std::chrono::steady_clock::now() + std::chrono::milliseconds(timeout);
+
+    while (true) {
+        if (slot->ring) {
+            slot->ring->setWaiting(true);
+        }
+
+        auto count = CountMessages(slot);
+        if (count > 0) {
+            if (slot->ring) {
+                slot->ring->setWaiting(false);
+            }
+
+            return count;
+        }
+
+        int wait = -1;
+        if (timeout > 0) {
+            auto left = std::chrono::duration_cast<std::chrono::milliseconds>(deadline - std::chrono::steady_clock::now()).count();
+            wait = left > 0 ? (int) left : 0;
+        }
+
+        bool woken = false;
+#ifdef __linux__
+        epoll_event events[2];
+        int ready = epoll_wait(slot->epfd, events, 2, wait);
+
+        for (int i = 0; i < ready; ++i) {
+            if (events[i].data.fd == slot->wakefd) {
+                uint64_t value;
+                while (read(slot->wakefd, &value, sizeof(value)) > 0);
+                woken = true;
+            }
+        }
+#else
+        pollfd fds[2] = {{slot->fd, POLLIN, 0}, {slot->wakefds[0], POLLIN, 0}};
+        int ready = poll(fds, 2, wait);
+
+        if (ready > 0 && (fds[1].revents & POLLIN)) {
+            char drain[64];
+            while (read(slot->wakefds[0], drain, sizeof(drain)) > 0);
+            woken = true;
+        }
+#endif
+
+        if (slot->ring) {
+            slot->ring->setWaiting(false);
+        }
+
+        if (ready == -1 && errno != EINTR) {
+            throw runtime_error(SocketError("Mail::WaitForMessages - wait failed"));
+        }
+
+        if (woken || (ready == 0 && timeout > 0)) {
+            return CountMessages(slot);
+        }
+    }
+}
+
+void WakeSlot(Slot* slot) {
+#ifdef __linux__
+    uint64_t one = 1;
+    write(slot->wakefd, &one, sizeof(one));
+#else
+    write(slot->wakefds[1], "", 1);
+#endif
+}
+
+//Copies up to 'max' messages into 'out' as [uint32 length][bytes] records,
+//in one pass over the pending queue, the ring and then the socket. Returns
+//the number copied. If the first message doesn't fit, returns 0 and sets
+//'used' to the buffer size it needs.
+unsigned int DrainMessages(Slot* slot, unsigned int max, char* out, std::size_t capacity, std::size_t& used) {
+    unsigned int count = 0;
+    used = 0;
+
+    auto append = [&](const char* data, std::size_t length) -> bool {
+        if (used + sizeof(uint32_t) + length > capacity) {
+            if (count == 0) {
+                used = sizeof(uint32_t) + length;
+            }
+            return false;
+        }
+
+        uint32_t header = (uint32_t) length;
+        memcpy(out + used, &header, sizeof(header));
+        memcpy(out + used + sizeof(header), data, length);
+        used += sizeof(header) + length;
+        count++;
+
+        return true;
+    };
+
+    while (count < max && !slot->pending.empty()) {
+        if (!append(slot->pending.front().data(), slot->pending.front().length())) {
+            return count;
+        }
+        slot->pending.pop_front();
+    }
+
+    std::size_t length;
+    while (count < max && slot->ring) {
+        auto data = slot->ring->front(length);
+        if (!data) {
+            break;
+        }
+        if (!append(data, length)) {
+            return count;
+        }
+        slot->ring->pop();
+    }
+
+    while (count < max && ReceiveDatagram(slot, length)) {
+        if (!append(&slot->buffer[0], length)) {
+            slot->pending.push_back(string(&slot->buffer[0], length));
+            return count;
+        }
+    }
+
+    return count;
+}
+
+//Copies the next message and a terminating null into 'out' if they fit.
+//Returns the space needed, or 0 if nothing is waiting. A message that
+//doesn't fit stays queued for the next call.
+std::size_t ReadInto(Slot* slot, char* out, std::size_t capacity) {
+    std::size_t length;
+
+    auto copy = [&](const char* data) -> bool {
+        if (length + 1 > capacity) {
+            return false;
+        }
+
+        memcpy(out, data, length);
+        out[length] = 0;
+
+        return true;
+    };
+
+    if (!slot->pending.empty()) {
+        length = slot->pending.front().length();
+        if (copy(slot->pending.front().data())) {
+            slot->pending.pop_front();
+        }
+
+        return length + 1;
+    }
+
+    if (slot->ring) {
+        auto data = slot->ring->front(length);
+        if (data) {
+            if (copy(data)) {
+                slot->ring->pop();
+            }
+
+            return length + 1;
+        }
+    }
+
+    if (!ReceiveDatagram(slot, length)) {
+        return 0;
+    }
+
+    if (!copy(&slot->buffer[0])) {
+        slot->pending.push_back(string(&slot->buffer[0], length));
+    }
+
+    return length + 1;
+}
+
+string Read(Slot* slot) {
+    string ret;
+    if (slot->ring && slot->ring->read(ret)) {
+        return ret;
+    }
+
+    if (slot->pending.empty() && PullPending(slot) == 0) {
+        return ""; //No Message
+    }
+
+    ret = std::move(slot->pending.front());
+    slot->pending.pop_front();
+
+    return ret;
+}
+
+#endif //PROJECT_UNIXSOCKETS_H
@@ -1,37 +1,48 @@
-#include <windows.h>
 #include <algorithm>
-#include <ctime>
-#include <sstream>
-#include <iomanip>
+#include <cstdlib>
+#include <cstring>
+
+#ifdef _WIN32
+#include <windows.h>
 #include "MailSlots.h"
 
-using std::stringstream;
-using std::string;
+#define SUL_EXPORT __declspec(dllexport)
 
 BOOL WINAPI DllMain(HINSTANCE hinstDLL, DWORD fdwReason, LPVOID lpvReserved) {
-    switch (fdwReason) {
-        case DLL_PROCESS_ATTACH: {
-            srand((unsigned int) time(0));
-            return TRUE;
-        }
-        default: {
-            return TRUE;
-        }
-    }
+    return TRUE;
 }
+#else
+#include "UnixSockets.h"
 
-string specialChars = "&=|";
+#define SUL_EXPORT __attribute__((visibility("default")))
+
+typedef void* HANDLE;
+#endif
+
+#include "Escape.h"
+#include "UID.h"
+
+using std::string;
 
+#ifdef _WIN32
 //NodeBase
-extern "C" HANDLE __declspec(dllexport) SUL_createNode(const char* slotName) {
+extern "C" SUL_EXPORT HANDLE SUL_createNode(const char* slotName) {
     return CreateSlot(slotName);
 }
 
-extern "C" bool __declspec(dllexport) SUL_send(const char* strMsg, const char* strDest) {
+extern "C" SUL_EXPORT void SUL_closeNode(HANDLE hSlot) {
+    CloseSlot(hSlot);
+}
+
+extern "C" SUL_EXPORT bool SUL_send(const char* strMsg, const char* strDest) {
     return static_cast<bool>(Write(const_cast<LPTSTR>(strDest), const_cast<LPTSTR>(strMsg)));
 }
 
-extern "C" bool __declspec(dllexport) SUL_mailslotExists(const char* path) {
+extern "C" SUL_EXPORT bool SUL_sendData(const char* data, unsigned int length, const char* strDest) {
+    return static_cast<bool>(WriteData(strDest, data, length));
+}
+
+extern "C" SUL_EXPORT bool SUL_mailslotExists(const char* path) {
     auto slot = CreateMailslot(path, 0, MAILSLOT_WAIT_FOREVER, NULL);
 
     if (!slot) {
@@ -43,7 +54,7 @@ extern "C" bool __declspec(dllexport) SUL_mailslotExists(const char* path) {
     return false; //Doesn't exist
 }
 
-extern "C" unsigned int __declspec(dllexport) SUL_countNewMessages(HANDLE hSlot) {
+extern "C" SUL_EXPORT unsigned int SUL_countNewMessages(HANDLE hSlot) {
     DWORD cbMessage;
     BOOL res = GetMailslotInfo(hSlot, NULL, NULL, &cbMessage, NULL);
 
@@ -54,8 +65,23 @@ extern "C" unsigned int __declspec(dllexport) SUL_countNewMessages(HANDLE hSlot)
     return cbMessage;
 }
 
+extern "C" SUL_EXPORT unsigned int SUL_waitForMessages(HANDLE hSlot, unsigned int timeout) {
+    return WaitForMessages(hSlot, timeout);
+}
+
+extern "C" SUL_EXPORT void SUL_wakeNode(HANDLE hSlot) {
+    WakeSlot(hSlot);
+}
+
 //LocalNode
-extern "C" const char* __declspec(dllexport) SUL_getNextMessage(HANDLE hSlot) {
+//Returns the buffer size the next message needs including its null, or 0 if
+//there is none. The message is only copied and taken off if it fits.
+extern "C" SUL_EXPORT unsigned int SUL_getNextMessageInto(HANDLE hSlot, char* buffer, unsigned int capacity) {
+    return (unsigned int) ReadInto(hSlot, buffer, capacity);
+}
+
+//Superseded by SUL_getNextMessageInto; the caller owns the returned array
+extern "C" SUL_EXPORT const char* SUL_getNextMessage(HANDLE hSlot) {
     auto str = Read(hSlot);
     auto cstr = new char[str.length() + 1];
 
@@ -67,18 +93,57 @@ extern "C" const char* __declspec(dllexport) SUL_getNextMessage(HANDLE hSlot) {
     return cstr;
 }
 
-//MessageBase
-extern "C" const char* __declspec(dllexport) SUL_generateUID(unsigned int segs) {
-    stringstream seg;
-    for (int i = 0; i < segs; ++i) {
-        seg << std::setfill('0') << std::setw(8) << std::uppercase << std::hex << rand() * rand();
-
-        if (i + 1 < segs) {
-            seg << "-";
-        }
-    }
+extern "C" SUL_EXPORT unsigned int SUL_getNextMessages(HANDLE hSlot, unsigned int max, char* buffer, unsigned int capacity, unsigned int* used) {
+    std::size_t bytes;
+    auto count = DrainMessages(hSlot, max, buffer, capacity, bytes);
+    *used = (unsigned int) bytes;
+
+    return count;
+}
+#else
+//NodeBase
+extern "C" SUL_EXPORT HANDLE SUL_createNode(const char* slotName) {
+    return CreateSlot(slotName);
+}
+
+extern "C" SUL_EXPORT void SUL_closeNode(HANDLE hSlot) {
+    CloseSlot(static_cast<Slot*>(hSlot));
+}
+
+extern "C" SUL_EXPORT bool SUL_send(const char* strMsg, const char* strDest) {
+    return Write(strDest, strMsg, strlen(strMsg));
+}
+
+extern "C" SUL_EXPORT bool SUL_sendData(const char* data, unsigned int length, const char* strDest) {
+    return Write(strDest, data, length);
+}
+
+extern "C" SUL_EXPORT bool SUL_mailslotExists(const char* path) {
+    return SlotExists(path);
+}
+
+extern "C" SUL_EXPORT unsigned int SUL_countNewMessages(HANDLE hSlot) {
+    return CountMessages(static_cast<Slot*>(hSlot));
+}
 
-    auto str = seg.str();
+extern "C" SUL_EXPORT unsigned int SUL_waitForMessages(HANDLE hSlot, unsigned int timeout) {
+    return WaitForMessages(static_cast<Slot*>(hSlot), timeout);
+}
+
+extern "C" SUL_EXPORT void SUL_wakeNode(HANDLE hSlot) {
+    WakeSlot(static_cast<Slot*>(hSlot));
+}
+
+//LocalNode
+//Returns the buffer size the next message needs including its null, or 0 if
+//there is none. The message is only copied and taken off if it fits.
+extern "C" SUL_EXPORT unsigned int SUL_getNextMessageInto(HANDLE hSlot, char* buffer, unsigned int capacity) {
+    return (unsigned int) ReadInto(static_cast<Slot*>(hSlot), buffer, capacity);
+}
+
+//Superseded by SUL_getNextMessageInto; the caller owns the returned array
+extern "C" SUL_EXPORT const char* SUL_getNextMessage(HANDLE hSlot) {
+    auto str = Read(static_cast<Slot*>(hSlot));
     auto cstr = new char[str.length() + 1];
 
     for (int j = 0; j < str.length(); ++j) {
@@ -89,45 +154,102 @@ extern "C" const char* __declspec(dllexport) SUL_generateUID(unsigned int segs)
     return cstr;
 }
 
-extern "C" const char* __declspec(dllexport) SUL_messageEncode(const char* cmsg) {
-    string ret;
-    string msg(cmsg);
+extern "C" SUL_EXPORT unsigned int SUL_getNextMessages(HANDLE hSlot, unsigned int max, char* buffer, unsigned int capacity, unsigned int* used) {
+    std::size_t bytes;
+    auto count = DrainMessages(static_cast<Slot*>(hSlot), max, buffer, capacity, bytes);
+    *used = (unsigned int) bytes;
 
-    for (int i = 0; i < msg.length(); ++i) {
-        if (specialChars.find(msg[i]) == -1) { //str[i] is not a special character
-            ret += msg[i];
-        } else { //str[i] is a special character - add an escape sequence
-            ret += "|";
-            ret += msg[i];
-        }
-    }
+    return count;
+}
+#endif
+
+//Destination cache
+extern "C" SUL_EXPORT void SUL_getEndpointCacheStats(unsigned long long* counters, unsigned int* size, unsigned int* capacity) {
+    auto stats = Destinations().stats();
+
+    counters[0] = stats.hits;
+    counters[1] = stats.misses;
+    counters[2] = stats.evictions;
+    counters[3] = stats.invalidations;
+    *size = stats.size;
+    *capacity = stats.capacity;
+}
+
+extern "C" SUL_EXPORT void SUL_setEndpointCacheCapacity(unsigned int capacity) {
+    Destinations().setCapacity(capacity);
+}
 
-    char* cret = new char[ret.length() + 1];
-    for (int j = 0; j < ret.length(); ++j) {
-        cret[j] = ret[j];
+//MessageBase
+//The '...Into' exports write a null terminated result into a caller-owned
+//buffer and return the size it needs, null included. Nothing is written if
+//the buffer is too small. The older exports return an array the caller
+//has to delete[].
+extern "C" SUL_EXPORT unsigned int SUL_generateUIDInto(unsigned int segs, char* buffer, unsigned int capacity) {
+    auto needed = (unsigned int) UID::TextLength(segs);
+
+    if (needed <= capacity) {
+        UID::WriteText(segs, buffer);
     }
-    cret[ret.length()] = 0;
 
-    return cret;
+    return needed;
+}
+
+//Fills 'length' bytes with the same per-thread generator, e.g. 16 for a
+//128-bit ID
+extern "C" SUL_EXPORT void SUL_generateUIDBinary(unsigned char* buffer, unsigned int length) {
+    UID::WriteBinary(buffer, length);
+}
+
+extern "C" SUL_EXPORT const char* SUL_generateUID(unsigned int segs) {
+    auto needed = SUL_generateUIDInto(segs, nullptr, 0);
+    auto cstr = new char[needed];
+
+    SUL_generateUIDInto(segs, cstr, needed);
+
+    return cstr;
 }
 
-extern "C" const char* __declspec(dllexport) SUL_messageDecode(const char* cmsg) {
-    string ret;
-    string msg(cmsg);
+extern "C" SUL_EXPORT unsigned int SUL_messageEncodeInto(const char* data, unsigned int length, char* buffer, unsigned int capacity) {
+    std::size_t needed = (capacity > Escape::MaxEncodedLength(length) ? Escape::MaxEncodedLength(length) : Escape::EncodedLength(data, length)) + 1;
 
-    for (int i = 0; i < msg.length(); ++i) {
-        if (msg[i] == '|') { //Escape sequence character is reached
-            ret += msg[++i]; //Ignore the escape sequence character
-        } else {
-            ret += msg[i];
-        }
+    if (needed > capacity) {
+        return (unsigned int) needed;
     }
 
-    char* cret = new char[ret.length() + 1];
-    for (int j = 0; j < ret.length(); ++j) {
-        cret[j] = ret[j];
+    auto written = Escape::Encode(data, length, buffer);
+    buffer[written] = 0;
+
+    return (unsigned int) written + 1;
+}
+
+extern "C" SUL_EXPORT unsigned int SUL_messageDecodeInto(const char* data, unsigned int length, char* buffer, unsigned int capacity) {
+    std::size_t needed = (capacity > length ? length : Escape::DecodedLength(data, length)) + 1;
+
+    if (needed > capacity) {
+        return (unsigned int) needed;
     }
-    cret[ret.length()] = 0;
+
+    auto written = Escape::Decode(data, length, buffer);
+    buffer[written] = 0;
+
+    return (unsigned int) written + 1;
+}
+
+extern "C" SUL_EXPORT const char* SUL_messageEncode(const char* cmsg) {
+    auto length = (unsigned int) strlen(cmsg);
+    auto capacity = (unsigned int) Escape::MaxEncodedLength(length) + 1;
+    char* cret = new char[capacity];
+
+    SUL_messageEncodeInto(cmsg, length, cret, capacity);
 
     return cret;
-}
\ No newline at end of file
+}
+
+extern "C" SUL_EXPORT const char* SUL_messageDecode(const char* cmsg) {
+    auto length = (unsigned int) strlen(cmsg);
+    char* cret = new char[length + 1];
+
+    SUL_messageDecodeInto(cmsg, length, cret, length + 1);
+
+    return cret;
+}
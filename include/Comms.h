@@ -2,14 +2,30 @@
 #define SULLY_COMMS_H
 
 #include "Sul.h"
+#include "Threading.h"
+#include "Latency.h"
+#include "Compression.h"
+#include <list>
 #include <map>
+#include <iterator>
+#include <unordered_map>
 #include <string>
 #include <vector>
+#include <deque>
 #include <exception>
-#include <windows.h>
 #include <functional>
+#include <algorithm>
+#include <atomic>
 #include <ctime>
 #include <cmath>
+#include <chrono>
+#include <cstdint>
+#include <cstring>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <condition_variable>
+#include <future>
 
 namespace Sul {
     namespace Comms {
@@ -19,14 +35,346 @@ namespace Sul {
         class LocalServer;
         class RemoteServer;
 
+        //Destination handles the library keeps open between sends
+        struct EndpointCacheStats {
+            unsigned long long hits = 0;
+            unsigned long long misses = 0;
+            unsigned long long evictions = 0;
+            unsigned long long invalidations = 0; //Dropped after a failed write
+            unsigned int size = 0;
+            unsigned int capacity = 0;
+        };
+
+        //Runtime counters. Each is updated with a relaxed atomic, so it is
+        //exact on its own, but counters read together may be a few messages
+        //apart.
+        struct NodeStats {
+            unsigned long long sent = 0;
+            unsigned long long sentBytes = 0;
+            unsigned long long received = 0;
+            unsigned long long receivedBytes = 0; //As framed on the transport
+            unsigned long long sendErrors = 0; //Writes the transport refused
+            unsigned long long rejected = 0; //Frames read that were malformed and dropped
+            unsigned long long parsed = 0;
+            unsigned long long parseNanos = 0;
+            unsigned long long compressed = 0; //Writes sent compressed
+            unsigned long long compressedIn = 0; //Bytes before compression
+            unsigned long long compressedOut = 0; //and after
+            unsigned long long compressNanos = 0; //Including attempts that didn't pay off
+            unsigned long long decompressed = 0;
+            unsigned long long decompressNanos = 0;
+        };
+
+        struct ReassemblyOptions {
+            std::size_t maxMessages = 64; //Partly received at once
+            std::size_t maxBytes = 64 * 1024 * 1024; //Held for partly received messages
+            std::size_t timeout = 5000; //ms from the first fragment
+        };
+
+        struct ReassemblyStats {
+            unsigned long long fragments = 0;
+            unsigned long long completed = 0;
+            unsigned long long expired = 0; //Not complete before the timeout
+            unsigned long long evicted = 0; //Dropped to make room
+            unsigned long long rejected = 0; //Fragments malformed or of a message larger than maxBytes
+            std::size_t partial = 0;
+            std::size_t bytes = 0;
+        };
+
+        struct EventStats {
+            unsigned long long calls = 0;
+            unsigned long long matches = 0;
+            unsigned long long nanos = 0; //Condition and handler together
+        };
+
+        struct ServerStats {
+            NodeStats node;
+            std::size_t queued = 0; //Received messages put aside for getNextMessage
+            std::size_t pendingReplies = 0;
+            ReassemblyStats reassembly;
+            std::map<std::size_t, EventStats> receiveEvents; //By event ID
+            std::map<std::size_t, EventStats> sendEvents;
+        };
+
+        //Hook for an intrusive, doubly-linked list. Nodes and servers track
+        //their live messages this way, so linking, unlinking and handing a
+        //place over to a moved-to message take constant time however many
+        //messages are alive.
+        template <class T>
+        struct LinkHook {
+            T* prev = nullptr;
+            T* next = nullptr;
+            bool linked = false;
+        };
+
+        //Operations on a list threaded through the LinkHook member 'Hook' of
+        //T, given a reference to its head. Only used once T is complete.
+        template <class T, LinkHook<T> T::*Hook>
+        struct Links {
+            //No effect if 'item' is already on a list
+            static void Push(T*& head, T* item) {
+                auto& hook = item->*Hook;
+                if (hook.linked) {
+                    return;
+                }
+
+                hook.prev = nullptr;
+                hook.next = head;
+                hook.linked = true;
+                if (head) {
+                    (head->*Hook).prev = item;
+                }
+                head = item;
+            }
+            //False if 'item' was not on a list
+            static bool Remove(T*& head, T* item) {
+                auto& hook = item->*Hook;
+                if (!hook.linked) {
+                    return false;
+                }
+
+                if (hook.prev) {
+                    (hook.prev->*Hook).next = hook.next;
+                } else {
+                    head = hook.next;
+                }
+                if (hook.next) {
+                    (hook.next->*Hook).prev = hook.prev;
+                }
+                hook = LinkHook<T>();
+
+                return true;
+            }
+            //Puts 'item' in the place of 'prev_item', which leaves the list.
+            //False if 'prev_item' was not on a list.
+            static bool Replace(T*& head, T* prev_item, T* item) {
+                auto& prev = prev_item->*Hook;
+                if (!prev.linked) {
+                    return false;
+                }
+
+                Remove(head, item); //In case it was linked on its own
+                auto& hook = item->*Hook;
+                hook = prev;
+                if (hook.prev) {
+                    (hook.prev->*Hook).next = item;
+                } else {
+                    head = item;
+                }
+                if (hook.next) {
+                    (hook.next->*Hook).prev = item;
+                }
+                prev = LinkHook<T>();
+
+                return true;
+            }
+            //Empties the list, calling fn(item) on each item once it is off
+            template <class Fn>
+            static void Clear(T*& head, Fn fn) {
+                while (head) {
+                    auto item = head;
+                    Remove(head, item);
+                    fn(item);
+                }
+            }
+            template <class Fn>
+            static void ForEach(T* head, Fn fn) {
+                for (; head; head = (head->*Hook).next) {
+                    fn(head);
+                }
+            }
+        };
+
+        //What a full RingQueue does with another item. There is no policy
+        //that waits for room: the server's queue is filled by the thread
+        //that drains it, which would wait forever.
+        enum class QueuePolicy {
+            DropOldest, //Make room by discarding the oldest item
+            DropNewest //Discard the item being added
+        };
+
+        struct QueueOptions {
+            std::size_t capacity = 4096;
+            std::size_t highWatermark = 0; //Size at which the policy kicks in; 0 for capacity
+            std::size_t lowWatermark = 0; //Size the queue must drain to before it accepts freely again; 0 for half the high watermark
+            QueuePolicy policy = QueuePolicy::DropOldest;
+        };
+
+        struct QueueStats {
+            std::size_t size = 0;
+            std::size_t capacity = 0;
+            std::size_t peak = 0; //Largest size so far
+            bool congested = false; //Between reaching the high watermark and draining to the low one
+            unsigned long long pushed = 0;
+            unsigned long long popped = 0;
+            unsigned long long droppedOldest = 0;
+            unsigned long long droppedNewest = 0;
+            unsigned long long congestions = 0; //Times the high watermark was reached
+        };
+
+        //Pings to one target, as kept by ServerBase
+        struct PingStats {
+            unsigned long long sent = 0;
+            unsigned long long lost = 0; //No reply before the timeout
+            Latency::Summary latency; //Round trips within the ping window
+        };
+
+        //Settings for a multi-threaded ServerBase::listen. listen throws if
+        //a thread can't be pinned to the CPU given for it.
+        struct ListenOptions {
+            std::size_t threads = 0; //Dispatch threads; 0 for one per hardware thread
+            std::vector<unsigned int> cpus; //CPU for each dispatch thread in turn; empty leaves it to the OS
+            int receiverCpu = -1; //CPU for the calling thread, which receives; -1 leaves it to the OS
+            std::size_t interval = 0; //Longest wait, in ms, for a message; 0 waits until one arrives, a deadline passes or stopListening
+            std::size_t queueLimit = 1024; //Messages waiting on one dispatch thread before receiving blocks
+        };
+
+        //Fixed capacity FIFO over a ring of slots, so neither end costs more
+        //than a move. Once the high watermark is reached the queue is
+        //congested and pushes follow its policy until pops bring it down to
+        //the low watermark.
+        template <class T>
+        class RingQueue {
+            std::vector<T> _slots;
+            std::size_t _head = 0;
+            std::size_t _count = 0;
+            QueueOptions _options;
+            QueueStats _stats;
+            std::mutex _lock;
+
+            std::size_t high() const {
+                return _options.highWatermark && _options.highWatermark < _slots.size() ? _options.highWatermark : _slots.size();
+            }
+            std::size_t low() const {
+                return std::min(_options.lowWatermark ? _options.lowWatermark : high() / 2, high() - 1);
+            }
+            void dropFront() {
+                _slots[_head] = T();
+                _head = (_head + 1) % _slots.size();
+                _count--;
+            }
+
+        public:
+            RingQueue(): RingQueue(QueueOptions()) {}
+            explicit RingQueue(QueueOptions options) {
+                configure(options);
+            }
+
+            //Keeps the newest items if the capacity shrinks below the size
+            void configure(QueueOptions options) {
+                std::lock_guard<std::mutex> guard(_lock);
+                options.capacity = std::max<std::size_t>(1, options.capacity);
+
+                std::vector<T> slots(options.capacity);
+                while (_count > options.capacity) {
+                    dropFront();
+                    _stats.droppedOldest++;
+                }
+                for (std::size_t i = 0; i < _count; ++i) {
+                    slots[i] = std::move(_slots[(_head + i) % _slots.size()]);
+                }
+
+                _slots.swap(slots);
+                _head = 0;
+                _options = options;
+                _stats.congested = _stats.congested && _count > low();
+            }
+
+            //Returns false if 'item' was dropped
+            bool push(T&& item) {
+                std::lock_guard<std::mutex> guard(_lock);
+
+                if (!_stats.congested && _count >= high()) {
+                    _stats.congested = true;
+                    _stats.congestions++;
+                }
+
+                if (_stats.congested) {
+                    if (_options.policy == QueuePolicy::DropNewest) {
+                        _stats.droppedNewest++;
+                        return false;
+                    }
+
+                    while (_count >= high()) {
+                        dropFront();
+                        _stats.droppedOldest++;
+                    }
+                }
+
+                _slots[(_head + _count) % _slots.size()] = std::move(item);
+                _count++;
+                _stats.pushed++;
+                _stats.peak = std::max(_stats.peak, _count);
+
+                return true;
+            }
+            //Returns false if the queue is empty
+            bool pop(T& out) {
+                std::lock_guard<std::mutex> guard(_lock);
+                if (_count == 0) {
+                    return false;
+                }
+
+                out = std::move(_slots[_head]);
+                _head = (_head + 1) % _slots.size();
+                _count--;
+                _stats.popped++;
+
+                if (_stats.congested && _count <= low()) {
+                    _stats.congested = false;
+                }
+
+                return true;
+            }
+            //Drops every item
+            void clear() {
+                std::lock_guard<std::mutex> guard(_lock);
+                while (_count) {
+                    dropFront();
+                }
+
+                _stats.congested = false;
+            }
+
+            std::size_t size() {
+                std::lock_guard<std::mutex> guard(_lock);
+                return _count;
+            }
+            bool empty() {
+                return size() == 0;
+            }
+            QueueStats stats() {
+                std::lock_guard<std::mutex> guard(_lock);
+                auto stats = _stats;
+                stats.size = _count;
+                stats.capacity = _slots.size();
+
+                return stats;
+            }
+        };
+
+        struct MessagePoolStats {
+            std::size_t capacity = 0; //Messages the pool owns
+            std::size_t inUse = 0; //Held by handles right now
+            std::size_t peak = 0; //Highest inUse so far
+            unsigned long long acquired = 0;
+            unsigned long long reused = 0; //Acquisitions served without allocating
+        };
+
         void SetDLLPath(std::string);
         std::string GetDLLPath();
         void SetMessageUIDLength(unsigned int);
         unsigned int GetMessageUIDLength();
+        std::string GenerateBinaryUID();
+        EndpointCacheStats GetEndpointCacheStats();
+        void SetEndpointCacheCapacity(unsigned int);
 
         class Base {
             friend void SetDLLPath(std::string);
             friend std::string GetDLLPath();
+            friend EndpointCacheStats GetEndpointCacheStats();
+            friend void SetEndpointCacheCapacity(unsigned int);
+            friend std::string GenerateBinaryUID();
 
         protected:
             static DynamicLibrary DLL;
@@ -34,17 +382,31 @@ namespace Sul {
             public:
                 //NodeBase
                 static HANDLE (*createNode)(const char*); //Name
+                static void (*closeNode)(HANDLE); //Mailslot handle
                 static void (*send)(const char*, const char*); //msg, dest
+                static bool (*sendData)(const char*, unsigned int, const char*); //data, length, dest
                 static bool (*mailslotExists)(const char*); //Path
                 static unsigned int (*countNewMessages)(HANDLE); //Mailslot handle
+                static unsigned int (*waitForMessages)(HANDLE, unsigned int); //Mailslot handle, timeout
+                static void (*wakeNode)(HANDLE); //Mailslot handle
 
                 //MessageBase
                 static const char* (*generateUID)(unsigned int); //Length
                 static const char* (*messageEncode)(const char*); //Message
                 static const char* (*messageDecode)(const char*); //Message
+                static unsigned int (*generateUIDInto)(unsigned int, char*, unsigned int); //Length, buffer, capacity
+                static void (*generateUIDBinary)(unsigned char*, unsigned int); //Buffer, length
+                static unsigned int (*messageEncodeInto)(const char*, unsigned int, char*, unsigned int); //Data, length, buffer, capacity
+                static unsigned int (*messageDecodeInto)(const char*, unsigned int, char*, unsigned int); //Data, length, buffer, capacity
 
                 //LocalNode
                 static const char* (*getNextMessage)(HANDLE); //MailSlot Handle
+                static unsigned int (*getNextMessageInto)(HANDLE, char*, unsigned int); //MailSlot Handle, buffer, capacity
+                static unsigned int (*getNextMessages)(HANDLE, unsigned int, char*, unsigned int, unsigned int*); //MailSlot Handle, max, buffer, capacity, used
+
+                //Destination cache
+                static void (*getEndpointCacheStats)(unsigned long long*, unsigned int*, unsigned int*); //Counters[4], size, capacity
+                static void (*setEndpointCacheCapacity)(unsigned int); //Capacity
             };
 
             template <class Type>
@@ -58,23 +420,43 @@ namespace Sul {
                     DLL.loadDLL();
 
                     LoadProc(CallDLL::createNode, "SUL_createNode");
+                    LoadProc(CallDLL::closeNode, "SUL_closeNode");
                     LoadProc(CallDLL::send, "SUL_send");
+                    LoadProc(CallDLL::sendData, "SUL_sendData");
                     LoadProc(CallDLL::mailslotExists, "SUL_mailslotExists");
                     LoadProc(CallDLL::countNewMessages, "SUL_countNewMessages");
+                    LoadProc(CallDLL::waitForMessages, "SUL_waitForMessages");
+                    LoadProc(CallDLL::wakeNode, "SUL_wakeNode");
                     LoadProc(CallDLL::generateUID, "SUL_generateUID");
                     LoadProc(CallDLL::getNextMessage, "SUL_getNextMessage");
+                    LoadProc(CallDLL::getNextMessages, "SUL_getNextMessages");
                     LoadProc(CallDLL::messageEncode, "SUL_messageEncode");
                     LoadProc(CallDLL::messageDecode, "SUL_messageDecode");
+                    LoadProc(CallDLL::generateUIDInto, "SUL_generateUIDInto");
+                    LoadProc(CallDLL::generateUIDBinary, "SUL_generateUIDBinary");
+                    LoadProc(CallDLL::messageEncodeInto, "SUL_messageEncodeInto");
+                    LoadProc(CallDLL::messageDecodeInto, "SUL_messageDecodeInto");
+                    LoadProc(CallDLL::getNextMessageInto, "SUL_getNextMessageInto");
+                    LoadProc(CallDLL::getEndpointCacheStats, "SUL_getEndpointCacheStats");
+                    LoadProc(CallDLL::setEndpointCacheCapacity, "SUL_setEndpointCacheCapacity");
                 }
             }
         };
+#ifdef _WIN32
         DynamicLibrary Base::DLL = DynamicLibrary("SComms.dll");
+#else
+        DynamicLibrary Base::DLL = DynamicLibrary("SComms.so");
+#endif
 
         //NodeBase
         HANDLE (*Base::CallDLL::createNode)(const char*) = nullptr; //Name
+        void (*Base::CallDLL::closeNode)(HANDLE) = nullptr; //Mailslot handle
         void (*Base::CallDLL::send)(const char*, const char*) = nullptr; //msg, dest
+        bool (*Base::CallDLL::sendData)(const char*, unsigned int, const char*) = nullptr; //data, length, dest
         bool (*Base::CallDLL::mailslotExists)(const char*) = nullptr; //Path
         unsigned int (*Base::CallDLL::countNewMessages)(HANDLE) = nullptr; //Mailslot handle
+        unsigned int (*Base::CallDLL::waitForMessages)(HANDLE, unsigned int) = nullptr; //Mailslot handle, timeout
+        void (*Base::CallDLL::wakeNode)(HANDLE) = nullptr; //Mailslot handle
         const char* (*generateUID)(unsigned int) = nullptr;
         const char* (*getNextMessage)(HANDLE) = nullptr;
 
@@ -82,9 +464,19 @@ namespace Sul {
         const char* (*Base::CallDLL::generateUID)(unsigned int) = nullptr; //Length
         const char* (*Base::CallDLL::messageEncode)(const char*) = nullptr; //Message
         const char* (*Base::CallDLL::messageDecode)(const char*) = nullptr; //Message
+        unsigned int (*Base::CallDLL::generateUIDInto)(unsigned int, char*, unsigned int) = nullptr; //Length, buffer, capacity
+        void (*Base::CallDLL::generateUIDBinary)(unsigned char*, unsigned int) = nullptr; //Buffer, length
+        unsigned int (*Base::CallDLL::messageEncodeInto)(const char*, unsigned int, char*, unsigned int) = nullptr; //Data, length, buffer, capacity
+        unsigned int (*Base::CallDLL::messageDecodeInto)(const char*, unsigned int, char*, unsigned int) = nullptr; //Data, length, buffer, capacity
 
         //LocalNode
         const char* (*Base::CallDLL::getNextMessage)(HANDLE) = nullptr; //MailSlot Handle
+        unsigned int (*Base::CallDLL::getNextMessageInto)(HANDLE, char*, unsigned int) = nullptr; //MailSlot Handle, buffer, capacity
+        unsigned int (*Base::CallDLL::getNextMessages)(HANDLE, unsigned int, char*, unsigned int, unsigned int*) = nullptr; //MailSlot Handle, max, buffer, capacity, used
+
+        //Destination cache
+        void (*Base::CallDLL::getEndpointCacheStats)(unsigned long long*, unsigned int*, unsigned int*) = nullptr; //Counters[4], size, capacity
+        void (*Base::CallDLL::setEndpointCacheCapacity)(unsigned int) = nullptr; //Capacity
 
         void SetDLLPath(std::string path) {
             Base::DLL.setDLLPath(path);
@@ -92,6 +484,304 @@ namespace Sul {
         std::string GetDLLPath() {
             return Base::DLL.getDLLPath();
         }
+        EndpointCacheStats GetEndpointCacheStats() {
+            Base base; //Loads the DLL if no node has yet
+
+            EndpointCacheStats stats;
+            unsigned long long counters[4];
+            Base::CallDLL::getEndpointCacheStats(counters, &stats.size, &stats.capacity);
+
+            stats.hits = counters[0];
+            stats.misses = counters[1];
+            stats.evictions = counters[2];
+            stats.invalidations = counters[3];
+
+            return stats;
+        }
+        void SetEndpointCacheCapacity(unsigned int capacity) {
+            Base base; //Loads the DLL if no node has yet
+            Base::CallDLL::setEndpointCacheCapacity(capacity);
+        }
+
+        //Encodings a node can send messages in. Nodes advertise the newest
+        //one they understand in their text messages and switch to it with
+        //peers that advertise it back, so older peers keep getting text.
+        enum class WireFormat: unsigned char {
+            Text = 0, //key=value pairs joined with '&' and escaped with '|'
+            Binary = 1 //Frame::Binary
+        };
+
+        //Transport frames carry one or more encoded messages in a single
+        //write. A frame opens with Frame::Marker, which never starts a
+        //text-encoded message, followed by a byte giving its kind.
+        namespace Frame {
+            const char Marker = '\x01';
+            const char Batch = 'B'; //Followed by "<length>:<message>" for each message
+            const char Binary = 'M'; //Followed by a version byte, then a varint length and the bytes of each key and value
+            const char Fragment = 'F'; //Followed by an 8 byte ID, the varint length of the whole and the varint offset of the bytes that follow
+            const char Compressed = 'Z'; //Followed by the varint length of the frame or message compressed, then the Compression output
+
+            const std::size_t FragmentIDLength = 8;
+
+            const unsigned char BinaryVersion = static_cast<unsigned char>(WireFormat::Binary);
+
+            //Largest a compressed frame may claim to expand to
+            const std::size_t MaxDecompressedSize = 256 * 1024 * 1024;
+
+            //Batches are closed once they pass this many bytes
+            const std::size_t MaxBatchSize = 60000;
+
+            //Writes larger than these are sent as fragments. Windows limits
+            //broadcasts to remote mailslots to 424 bytes; the rest stays well
+            //inside every transport's datagram limit.
+            const std::size_t MaxWrite = 60000;
+            const std::size_t MaxBroadcastWrite = 424;
+
+            bool IsFrame(const char* data, std::size_t length) {
+                return length >= 2 && data[0] == Marker;
+            }
+
+            //Lengths are written 7 bits at a time, low bits first
+            void AppendLength(std::string& out, std::size_t length) {
+                while (length >= 0x80) {
+                    out += static_cast<char>((length & 0x7f) | 0x80);
+                    length >>= 7;
+                }
+
+                out += static_cast<char>(length);
+            }
+
+            std::size_t ReadLength(const char*& pos, const char* end) {
+                std::size_t length = 0;
+
+                for (unsigned int shift = 0; pos < end && shift < 64; shift += 7) {
+                    auto byte = static_cast<unsigned char>(*pos++);
+                    length |= static_cast<std::size_t>(byte & 0x7f) << shift;
+
+                    if (!(byte & 0x80)) {
+                        if (length > static_cast<std::size_t>(end - pos)) {
+                            break;
+                        }
+
+                        return length;
+                    }
+                }
+
+                throw std::runtime_error("Frame::ReadLength - malformed binary message");
+            }
+
+            //As ReadLength, for numbers that aren't followed by that many bytes
+            std::size_t ReadNumber(const char*& pos, const char* end) {
+                std::size_t number = 0;
+
+                for (unsigned int shift = 0; pos < end && shift < 64; shift += 7) {
+                    auto byte = static_cast<unsigned char>(*pos++);
+                    number |= static_cast<std::size_t>(byte & 0x7f) << shift;
+
+                    if (!(byte & 0x80)) {
+                        return number;
+                    }
+                }
+
+                throw std::runtime_error("Frame::ReadNumber - malformed number");
+            }
+
+            //Fragment header for the bytes at 'offset' of a 'total' byte whole
+            void AppendFragmentHeader(std::string& out, const unsigned char* id, std::size_t total, std::size_t offset) {
+                out += Marker;
+                out += Fragment;
+                out.append(reinterpret_cast<const char*>(id), FragmentIDLength);
+                AppendLength(out, total);
+                AppendLength(out, offset);
+            }
+
+            void AppendToBatch(std::string& frame, const std::string& message) {
+                if (frame.empty()) {
+                    frame += Marker;
+                    frame += Batch;
+                }
+
+                frame += std::to_string(message.length()) + ":" + message;
+            }
+
+            //Calls sink(data, length) for each message in the batch
+            template <class Sink>
+            void UnpackBatch(const char* frame, std::size_t length, Sink sink) {
+                std::size_t pos = 2;
+
+                while (pos < length) {
+                    std::size_t sep = pos, size = 0;
+                    while (sep < length && frame[sep] >= '0' && frame[sep] <= '9') {
+                        size = size * 10 + (frame[sep++] - '0');
+                    }
+
+                    if (sep == pos || sep >= length || frame[sep] != ':') {
+                        throw std::runtime_error("Frame::UnpackBatch - malformed batch frame");
+                    }
+                    if (size > length - sep - 1) {
+                        throw std::runtime_error("Frame::UnpackBatch - batch frame is truncated");
+                    }
+
+                    sink(frame + sep + 1, size);
+                    pos = sep + 1 + size;
+                }
+            }
+
+            //Splits 'data' into the messages it carries, calling sink(data,
+            //length) for each
+            template <class Sink>
+            void Unpack(const char* data, std::size_t length, Sink sink) {
+                if (!IsFrame(data, length)) {
+                    sink(data, length);
+                    return;
+                }
+
+                switch (data[1]) {
+                    case Batch: UnpackBatch(data, length, sink); break;
+                    case Binary: sink(data, length); break;
+                    case Fragment: throw std::runtime_error("Frame::Unpack - fragments must be reassembled first");
+                    case Compressed: throw std::runtime_error("Frame::Unpack - compressed frames must be expanded first");
+                    default: throw std::runtime_error("Frame::Unpack - unknown frame kind");
+                }
+            }
+        }
+
+        //Puts fragmented writes back together. Partly received messages are
+        //dropped once they time out, and the oldest are dropped when a limit
+        //would be passed, so a lost fragment costs bounded memory.
+        class Reassembly {
+            typedef std::chrono::steady_clock Clock;
+
+            struct Partial {
+                std::string data;
+                std::map<std::size_t, std::size_t> spans; //Offset to end of each fragment in
+                std::size_t received = 0;
+                Clock::time_point deadline;
+            };
+
+            std::map<std::string, Partial> _partial; //By fragment ID
+            std::deque<std::string> _order; //IDs, oldest first; may name ones already finished
+            std::size_t _bytes = 0;
+            ReassemblyOptions _options;
+            ReassemblyStats _stats;
+            std::mutex _lock;
+
+            void drop(std::map<std::string, Partial>::iterator partial) {
+                _bytes -= partial->second.data.size();
+                _partial.erase(partial);
+            }
+            //As above, swapping the data into 'out'
+            void drop(std::map<std::string, Partial>::iterator partial, std::string& out) {
+                _bytes -= partial->second.data.size();
+                out.swap(partial->second.data);
+                _partial.erase(partial);
+            }
+            //Drops the oldest partial message, if any. '_lock' must be held.
+            bool dropOldest(bool expiredOnly) {
+                while (!_order.empty()) {
+                    auto partial = _partial.find(_order.front());
+                    if (partial == _partial.end()) {
+                        _order.pop_front();
+                        continue;
+                    }
+
+                    if (expiredOnly && partial->second.deadline > Clock::now()) {
+                        return false;
+                    }
+
+                    drop(partial);
+                    _order.pop_front();
+                    (expiredOnly ? _stats.expired : _stats.evicted)++;
+
+                    return true;
+                }
+
+                return false;
+            }
+
+        public:
+            void configure(ReassemblyOptions options) {
+                std::lock_guard<std::mutex> guard(_lock);
+                _options = options;
+                while ((_partial.size() > _options.maxMessages || _bytes > _options.maxBytes) && dropOldest(false)) {}
+            }
+            ReassemblyStats stats() {
+                std::lock_guard<std::mutex> guard(_lock);
+                auto stats = _stats;
+                stats.partial = _partial.size();
+                stats.bytes = _bytes;
+
+                return stats;
+            }
+
+            //Takes in a fragment frame. Returns true once the last fragment
+            //of a message is in, with the whole swapped into 'out'.
+            bool add(const char* frame, std::size_t length, std::string& out) {
+                std::lock_guard<std::mutex> guard(_lock);
+                _stats.fragments++;
+                while (dropOldest(true)) {}
+
+                const char* end = frame + length;
+                const char* pos = frame + 2;
+                std::size_t total, offset;
+                if (static_cast<std::size_t>(end - pos) < Frame::FragmentIDLength) {
+                    _stats.rejected++;
+                    return false;
+                }
+
+                std::string id(pos, Frame::FragmentIDLength);
+                pos += Frame::FragmentIDLength;
+                try {
+                    total = Frame::ReadNumber(pos, end);
+                    offset = Frame::ReadNumber(pos, end);
+                } catch (std::runtime_error&) {
+                    _stats.rejected++;
+                    return false;
+                }
+
+                auto size = static_cast<std::size_t>(end - pos);
+                if (total > _options.maxBytes || offset > total || size > total - offset || _options.maxMessages == 0) {
+                    _stats.rejected++;
+                    return false;
+                }
+
+                auto partial = _partial.find(id);
+                if (partial == _partial.end()) {
+                    while ((_partial.size() >= _options.maxMessages || _bytes + total > _options.maxBytes) && dropOldest(false)) {}
+
+                    partial = _partial.emplace(id, Partial()).first;
+                    partial->second.data.resize(total);
+                    partial->second.deadline = Clock::now() + std::chrono::milliseconds(_options.timeout);
+                    _bytes += total;
+                    _order.push_back(id);
+                }
+
+                //A repeat is ignored. Any other overlap would count bytes
+                //twice and let the message complete with gaps in it.
+                auto& whole = partial->second;
+                auto next = whole.spans.lower_bound(offset);
+                if (next != whole.spans.end() && next->first == offset && next->second == offset + size) {
+                    return false;
+                }
+                if ((next != whole.spans.end() && (next->first == offset || next->first < offset + size)) ||
+                        (next != whole.spans.begin() && std::prev(next)->second > offset)) {
+                    _stats.rejected++;
+                    return false;
+                }
+                whole.spans.emplace_hint(next, offset, offset + size);
+
+                memcpy(&whole.data[offset], pos, size);
+                whole.received += size;
+                if (whole.received < total) {
+                    return false;
+                }
+
+                drop(partial, out);
+                _stats.completed++;
+
+                return true;
+            }
+        };
 
         class NodeBase: Base {
             friend class MessageBase;
@@ -101,37 +791,262 @@ namespace Sul {
 
             std::string _client_id;
             HANDLE _slot_handle = nullptr;
-            std::vector<MessageBase*> _msg_links;
+            MessageBase* _msg_links = nullptr; //Head of the list of live messages linked to this node
+            std::deque<std::string> _unpacked; //Messages taken off the transport but not yet read
+            std::vector<std::string> _spare; //Buffers of read messages, refilled by the next drainTransport
+            std::vector<char> _receive_buffer; //Reused by every drainTransport
+            std::mutex _link_lock; //Messages are created and destroyed on any thread
+            WireFormat _wire_format = WireFormat::Binary; //Newest format this node will send
+            //Formats agreed with each peer, most recently used first. Bounded,
+            //as sender IDs come from the peers; one that is dropped goes back
+            //to text and advertising until it is heard from again.
+            typedef std::list<std::pair<std::string, WireFormat>> PeerFormats;
+            static const std::size_t PeerFormatLimit = 1024;
+            PeerFormats _peer_formats;
+            std::unordered_map<std::string, PeerFormats::iterator> _peer_index; //By client ID
+            std::mutex _peer_lock;
+            Reassembly _reassembly;
+            std::string _reassembled; //Buffer for the last message put back together
+
+            struct Counters {
+                std::atomic<unsigned long long> sent{0};
+                std::atomic<unsigned long long> sentBytes{0};
+                std::atomic<unsigned long long> received{0};
+                std::atomic<unsigned long long> receivedBytes{0};
+                std::atomic<unsigned long long> sendErrors{0};
+                std::atomic<unsigned long long> rejected{0};
+                std::atomic<unsigned long long> parsed{0};
+                std::atomic<unsigned long long> parseNanos{0};
+                std::atomic<unsigned long long> compressed{0};
+                std::atomic<unsigned long long> compressedIn{0};
+                std::atomic<unsigned long long> compressedOut{0};
+                std::atomic<unsigned long long> compressNanos{0};
+                std::atomic<unsigned long long> decompressed{0};
+                std::atomic<unsigned long long> decompressNanos{0};
+            } _counters;
+            std::atomic<std::size_t> _compression_threshold{0}; //0 for off
+
+            static void Count(std::atomic<unsigned long long>& counter, unsigned long long amount) {
+                counter.fetch_add(amount, std::memory_order_relaxed);
+            }
+            static void CountSince(std::atomic<unsigned long long>& counter, std::chrono::steady_clock::time_point start) {
+                Count(counter, std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now() - start).count());
+            }
+            //Compresses 'data' into a frame in 'out' if it is over the
+            //threshold. Returns false if it isn't, or if compressing doesn't
+            //make it smaller.
+            bool compress(std::string const& data, std::string& out) {
+                auto threshold = _compression_threshold.load(std::memory_order_relaxed);
+                if (threshold == 0 || data.length() < threshold) {
+                    return false;
+                }
+
+                auto start = std::chrono::steady_clock::now();
+                out.clear();
+                out += Frame::Marker;
+                out += Frame::Compressed;
+                Frame::AppendLength(out, data.length());
+                Compression::Compress(data.data(), data.length(), out);
+                CountSince(_counters.compressNanos, start);
+
+                if (out.length() >= data.length()) {
+                    return false;
+                }
+
+                Count(_counters.compressed, 1);
+                Count(_counters.compressedIn, data.length());
+                Count(_counters.compressedOut, out.length());
+
+                return true;
+            }
+            //Hands 'messages' messages encoded in 'data' to the transport,
+            //compressed if that is on and pays off, and split into fragments
+            //if too large for one write
+            void write(std::string const& data, std::string const& dest, std::size_t messages) {
+                static thread_local std::string compressed; //Only grows
+                auto& out = compress(data, compressed) ? compressed : data;
+
+                auto limit = dest.compare(0, 4, "\\\\*\\") == 0 ? Frame::MaxBroadcastWrite : Frame::MaxWrite;
+                if (out.length() > limit) {
+                    writeFragments(out, dest, messages, limit);
+                } else {
+                    writeFrame(out, dest, messages);
+                }
+            }
+            void writeFrame(std::string const& data, std::string const& dest, std::size_t messages) {
+                bool written;
+                try {
+                    written = CallDLL::sendData(data.data(), static_cast<unsigned int>(data.length()), dest.c_str());
+                } catch (...) {
+                    Count(_counters.sendErrors, 1);
+                    throw;
+                }
+
+                if (written) {
+                    Count(_counters.sent, messages);
+                    Count(_counters.sentBytes, data.length());
+                } else {
+                    Count(_counters.sendErrors, 1);
+                }
+            }
+            void writeFragments(std::string const& data, std::string const& dest, std::size_t messages, std::size_t limit) {
+                unsigned char id[Frame::FragmentIDLength];
+                CallDLL::generateUIDBinary(id, sizeof(id));
+
+                std::string fragment;
+                for (std::size_t offset = 0; offset < data.length();) {
+                    fragment.clear();
+                    Frame::AppendFragmentHeader(fragment, id, data.length(), offset);
+
+                    auto size = std::min(limit - fragment.length(), data.length() - offset);
+                    fragment.append(data, offset, size);
+                    offset += size;
+
+                    writeFrame(fragment, dest, offset == data.length() ? messages : 0);
+                }
+            }
 
         protected:
             virtual void send(MessageBase& msg, std::string mailslot_prefix);
             virtual void send(MessageBase& msg) = 0;
-            void onDeletedMessage(MessageBase* msg) {
-                for (int i = 0; i < _msg_links.size(); ++i) {
-                    if (_msg_links[i] == msg) {
-                        _msg_links.erase(_msg_links.begin() + i);
-                        return;
-                    }
+            void sendBatch(std::vector<MessageBase*>& msgs, std::string mailslot_prefix);
+            virtual void sendBatch(std::vector<MessageBase*>& msgs) = 0;
+            const std::string& encodeFor(MessageBase& msg);
+            void learnWireFormat(MessageBase& msg);
+            //'_peer_lock' must be held
+            void setPeerWireFormat(std::string const& clientID, WireFormat format) {
+                auto it = _peer_index.find(clientID);
+                if (it != _peer_index.end()) {
+                    it->second->second = format;
+                    _peer_formats.splice(_peer_formats.begin(), _peer_formats, it->second);
+                    return;
                 }
 
-                throw std::runtime_error("Sul::Comms::NodeBase::onDeletedMessage - the given pointer was not part of the message list");
+                _peer_formats.emplace_front(clientID, format);
+                _peer_index[clientID] = _peer_formats.begin();
+                if (_peer_formats.size() > PeerFormatLimit) {
+                    _peer_index.erase(_peer_formats.back().first);
+                    _peer_formats.pop_back();
+                }
             }
-            void addLink(MessageBase* link) {
-                _msg_links.push_back(link);
+            //Records a message parsed since 'start'
+            void countParse(std::chrono::steady_clock::time_point start) {
+                Count(_counters.parsed, 1);
+                Count(_counters.parseNanos, std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now() - start).count());
+            }
+            void onDeletedMessage(MessageBase* msg);
+            void addLink(MessageBase* link);
+            void changeLink(MessageBase* prev_msg, MessageBase* new_msg);
+            void adoptLinks(NodeBase& node);
+            //Frame::Unpack, after putting fragments back together and
+            //expanding compressed frames
+            template <class Sink>
+            void unpack(const char* data, std::size_t length, Sink& sink) {
+                if (Frame::IsFrame(data, length) && data[1] == Frame::Fragment) {
+                    if (_reassembly.add(data, length, _reassembled)) {
+                        std::string whole;
+                        whole.swap(_reassembled);
+                        unpack(whole.data(), whole.length(), sink);
+                    }
+                    return;
+                }
+
+                if (Frame::IsFrame(data, length) && data[1] == Frame::Compressed) {
+                    auto start = std::chrono::steady_clock::now();
+                    const char* pos = data + 2;
+                    std::size_t expected = Frame::ReadNumber(pos, data + length);
+                    if (expected > Frame::MaxDecompressedSize) {
+                        throw std::runtime_error("NodeBase::unpack - compressed frame is too large");
+                    }
+
+                    std::string whole;
+                    Compression::Decompress(pos, data + length - pos, expected, whole);
+                    Count(_counters.decompressed, 1);
+                    CountSince(_counters.decompressNanos, start);
+
+                    unpack(whole.data(), whole.length(), sink);
+                    return;
+                }
+
+                Frame::Unpack(data, length, sink);
             }
-            void changeLink(MessageBase* prev_msg, MessageBase* new_msg) {
-                for (int i = 0; i < _msg_links.size(); ++i) {
-                    if (_msg_links[i] == prev_msg) {
-                        _msg_links[i] = new_msg;
-                        return;
+            //Takes up to 'max' messages off the transport with one call and
+            //splits any frames among them into '_unpacked'. Returns the number
+            //of messages added. Malformed frames are counted and dropped, so
+            //they don't cost the rest of the read.
+            std::size_t drainTransport(std::size_t max) {
+                if (_receive_buffer.empty()) {
+                    _receive_buffer.resize(64 * 1024);
+                }
+
+                auto before = _unpacked.size();
+                auto sink = [this](const char* data, std::size_t size) {
+                    queueUnpacked(data, size);
+                };
+
+                //Fragments add nothing until the last one, so keep reading
+                //while the transport has any
+                unsigned int count;
+                do {
+                    unsigned int used;
+                    while ((count = CallDLL::getNextMessages(_slot_handle, static_cast<unsigned int>(max), _receive_buffer.data(),
+                                                             static_cast<unsigned int>(_receive_buffer.size()), &used)) == 0 && used > 0) {
+                        _receive_buffer.resize(used); //The next message needs a bigger buffer
                     }
+
+                    const char* pos = _receive_buffer.data();
+                    for (unsigned int i = 0; i < count; ++i) {
+                        uint32_t length;
+                        memcpy(&length, pos, sizeof(length));
+                        Count(_counters.receivedBytes, length);
+
+                        try {
+                            unpack(pos + sizeof(length), length, sink);
+                        } catch (std::runtime_error&) {
+                            Count(_counters.rejected, 1);
+                        }
+                        pos += sizeof(length) + length;
+                    }
+                } while (count > 0 && _unpacked.size() == before);
+                Count(_counters.received, _unpacked.size() - before);
+
+                return _unpacked.size() - before;
+            }
+            std::string baseGetNextMessage() {
+                if (_unpacked.empty() && drainTransport(1) == 0) {
+                    throw std::runtime_error("NodeBase::getNextMessage - there are no messages waiting");
                 }
 
-                throw std::runtime_error("Sul::Comms::NodeBase::changeLink - the given pointer to be replaced was not part of the message list");
+                auto ret = std::move(_unpacked.front());
+                _unpacked.pop_front();
+
+                return ret;
             }
-            const char* baseGetNextMessage() {
-                return CallDLL::getNextMessage(this->_slot_handle);
+            //As baseGetNextMessage, but swaps the message into 'into' and keeps
+            //the buffer 'into' held for a later message
+            void takeNextMessage(std::string& into) {
+                if (_unpacked.empty() && drainTransport(1) == 0) {
+                    throw std::runtime_error("NodeBase::getNextMessage - there are no messages waiting");
+                }
+
+                into.swap(_unpacked.front());
+                if (_spare.size() < SpareBuffers) {
+                    _spare.push_back(std::move(_unpacked.front()));
+                }
+                _unpacked.pop_front();
             }
+            void queueUnpacked(const char* data, std::size_t length) {
+                if (_spare.empty()) {
+                    _unpacked.emplace_back(data, length);
+                    return;
+                }
+
+                _unpacked.push_back(std::move(_spare.back()));
+                _spare.pop_back();
+                _unpacked.back().assign(data, length);
+            }
+
+            static const std::size_t SpareBuffers = 64;
 
             NodeBase(std::string& clientID) {
                 if (NodeBase::Exists(clientID)) {
@@ -164,9 +1079,7 @@ namespace Sul {
         public:
             NodeBase(NodeBase&& node) {
                 _client_id = node._client_id;
-                _msg_links = node._msg_links;
-
-                node._msg_links.erase(node._msg_links.begin(), node._msg_links.end() - 1);
+                adoptLinks(node);
 
                 _slot_handle = node._slot_handle;
                 node._slot_handle = nullptr;
@@ -174,9 +1087,7 @@ namespace Sul {
             virtual ~NodeBase();
             NodeBase& operator=(NodeBase&& node) {
                 _client_id = node._client_id;
-                _msg_links = node._msg_links;
-
-                node._msg_links.erase(node._msg_links.begin(), node._msg_links.end() - 1);
+                adoptLinks(node);
 
                 _slot_handle = node._slot_handle;
                 node._slot_handle = nullptr;
@@ -187,12 +1098,118 @@ namespace Sul {
             std::string getCliendID() {
                 return _client_id;
             }
+            //A frame still waiting on the transport counts as one message
             unsigned int numNewMessages() {
-                return CallDLL::countNewMessages(_slot_handle);
+                return static_cast<unsigned int>(_unpacked.size()) + CallDLL::countNewMessages(_slot_handle);
             }
             bool hasNewMessages() {
                 return numNewMessages() > 0;
             }
+            //Blocks until a message arrives, 'timeout' ms pass (0 waits
+            //indefinitely) or wake() is called. Returns hasNewMessages().
+            bool waitForNewMessages(std::size_t timeout) {
+                if (!_unpacked.empty()) {
+                    return true;
+                }
+
+                return CallDLL::waitForMessages(_slot_handle, static_cast<unsigned int>(timeout)) > 0;
+            }
+            //As above, but only gives up once 'timeout' has passed
+            bool awaitNewMessages(std::size_t timeout) {
+                auto deadline = std::chrono::steady_clock::now() + std::chrono::milliseconds(timeout);
+
+                //Drains rather than counting, so a lone fragment doesn't pass
+                //for a message
+                while (_unpacked.empty() && (!hasNewMessages() || drainTransport(1) == 0)) {
+                    std::size_t remaining = 0;
+
+                    if (timeout > 0) {
+                        auto left = std::chrono::duration_cast<std::chrono::milliseconds>(deadline - std::chrono::steady_clock::now()).count();
+                        if (left <= 0) {
+                            return false;
+                        }
+
+                        remaining = static_cast<std::size_t>(left);
+                    }
+
+                    waitForNewMessages(remaining);
+                }
+
+                return true;
+            }
+            //WireFormat::Text turns negotiation off; every message goes out as
+            //text without advertising anything newer
+            void setWireFormat(WireFormat format) {
+                _wire_format = format;
+            }
+            WireFormat getWireFormat() {
+                return _wire_format;
+            }
+            WireFormat getPeerWireFormat(std::string clientID) {
+                std::lock_guard<std::mutex> guard(_peer_lock);
+                auto it = _peer_index.find(clientID);
+                if (it == _peer_index.end()) {
+                    return WireFormat::Text;
+                }
+
+                _peer_formats.splice(_peer_formats.begin(), _peer_formats, it->second);
+                return it->second->second;
+            }
+
+            //Compresses writes of at least 'bytes' bytes; 0, the default, turns
+            //compression off. Receivers must be new enough to expand them, so
+            //it is meant for links where both ends are known, typically
+            //RemoteNode traffic between hosts.
+            void setCompressionThreshold(std::size_t bytes) {
+                _compression_threshold.store(bytes, std::memory_order_relaxed);
+            }
+            std::size_t getCompressionThreshold() {
+                return _compression_threshold.load(std::memory_order_relaxed);
+            }
+            //Limits on messages that arrive in fragments and are waiting for
+            //the rest
+            void setReassemblyOptions(ReassemblyOptions options) {
+                _reassembly.configure(options);
+            }
+            ReassemblyStats getReassemblyStats() {
+                return _reassembly.stats();
+            }
+            NodeStats getStats() {
+                NodeStats stats;
+                stats.sent = _counters.sent.load(std::memory_order_relaxed);
+                stats.sentBytes = _counters.sentBytes.load(std::memory_order_relaxed);
+                stats.received = _counters.received.load(std::memory_order_relaxed);
+                stats.receivedBytes = _counters.receivedBytes.load(std::memory_order_relaxed);
+                stats.sendErrors = _counters.sendErrors.load(std::memory_order_relaxed);
+                stats.rejected = _counters.rejected.load(std::memory_order_relaxed);
+                stats.parsed = _counters.parsed.load(std::memory_order_relaxed);
+                stats.parseNanos = _counters.parseNanos.load(std::memory_order_relaxed);
+                stats.compressed = _counters.compressed.load(std::memory_order_relaxed);
+                stats.compressedIn = _counters.compressedIn.load(std::memory_order_relaxed);
+                stats.compressedOut = _counters.compressedOut.load(std::memory_order_relaxed);
+                stats.compressNanos = _counters.compressNanos.load(std::memory_order_relaxed);
+                stats.decompressed = _counters.decompressed.load(std::memory_order_relaxed);
+                stats.decompressNanos = _counters.decompressNanos.load(std::memory_order_relaxed);
+
+                return stats;
+            }
+
+            //Cuts short a waitForNewMessages call on another thread
+            void wake() {
+                CallDLL::wakeNode(_slot_handle);
+            }
+
+            //Sends every message in [first, last). Messages going to the same
+            //target share a transport write and are split up again on arrival.
+            template <class Iterator>
+            void sendBatch(Iterator first, Iterator last) {
+                std::vector<MessageBase*> msgs;
+                for (; first != last; ++first) {
+                    msgs.push_back(&static_cast<MessageBase&>(*first));
+                }
+
+                sendBatch(msgs);
+            }
 
             static bool Exists(std::string path) {
                 return CallDLL::mailslotExists(("\\\\.\\mailslot\\" + Prefix + path).c_str());
@@ -200,76 +1217,472 @@ namespace Sul {
 
             static std::string Prefix;
         };
+        //Keys every message carries or the library reads itself, in key order
+        enum class Header: unsigned char {
+            Action,
+            ForwardTo,
+            ReplyTo,
+            Scope,
+            Sender,
+            Status,
+            Target,
+            Type,
+            UID,
+            Count
+        };
+
+        //Storage behind a message's key/value pairs. Headers sit in fixed
+        //slots so the library's own lookups never search or allocate a node;
+        //any other keys go in a vector kept sorted by key, which for the few
+        //keys a message has beats a tree on both size and lookup time.
+        class MessageFields {
+        public:
+            typedef std::pair<std::string, std::string> Field;
+            static const std::size_t HeaderCount = static_cast<std::size_t>(Header::Count);
+
+        private:
+            std::string _headers[HeaderCount];
+            uint16_t _present = 0; //Bit per header slot in use
+            std::vector<Field> _fields;
+
+            static bool Set(uint16_t mask, std::size_t index) {
+                return (mask & (1u << index)) != 0;
+            }
+
+            std::vector<Field>::const_iterator lowerBound(const std::string& key) const {
+                return std::lower_bound(_fields.begin(), _fields.end(), key, [](const Field& field, const std::string& key) {
+                    return field.first < key;
+                });
+            }
+            std::vector<Field>::iterator lowerBound(const std::string& key) {
+                return std::lower_bound(_fields.begin(), _fields.end(), key, [](const Field& field, const std::string& key) {
+                    return field.first < key;
+                });
+            }
+
+        public:
+            static const std::string& Name(Header header) {
+                static const std::string names[HeaderCount] = {
+                    "action", "forward-to", "reply-to", "scope", "sender", "status", "target", "type", "uid"
+                };
+
+                return names[static_cast<std::size_t>(header)];
+            }
+            //Returns the header slot for 'key', or -1 if it isn't a header
+            static int HeaderIndex(const char* key, std::size_t length) {
+                Header header;
+                switch (length) {
+                    case 3: header = Header::UID; break;
+                    case 4: header = Header::Type; break;
+                    case 5: header = Header::Scope; break;
+                    case 6:
+                        switch (key[1]) {
+                            case 'a': header = Header::Target; break;
+                            case 'e': header = Header::Sender; break;
+                            case 't': header = Header::Status; break;
+                            case 'c': header = Header::Action; break;
+                            default: return -1;
+                        }
+                        break;
+                    case 8: header = Header::ReplyTo; break;
+                    case 10: header = Header::ForwardTo; break;
+                    default: return -1;
+                }
+
+                auto index = static_cast<int>(header);
+                return memcmp(key, Name(header).data(), length) == 0 ? index : -1;
+            }
+
+            std::string& operator[](Header header) {
+                auto index = static_cast<std::size_t>(header);
+                _present |= static_cast<uint16_t>(1u << index);
+
+                return _headers[index];
+            }
+            std::string& operator[](const std::string& key) {
+                auto index = HeaderIndex(key.data(), key.length());
+                if (index >= 0) {
+                    return (*this)[static_cast<Header>(index)];
+                }
+
+                auto it = lowerBound(key);
+                if (it == _fields.end() || it->first != key) {
+                    it = _fields.insert(it, Field(key, std::string()));
+                }
+
+                return it->second;
+            }
+
+            //nullptr if the key isn't set
+            const std::string* find(Header header) const {
+                auto index = static_cast<std::size_t>(header);
+
+                return Set(_present, index) ? &_headers[index] : nullptr;
+            }
+            const std::string* find(const std::string& key) const {
+                auto index = HeaderIndex(key.data(), key.length());
+                if (index >= 0) {
+                    return find(static_cast<Header>(index));
+                }
+
+                auto it = lowerBound(key);
+                return it != _fields.end() && it->first == key ? &it->second : nullptr;
+            }
+            bool contains(const std::string& key) const {
+                return find(key) != nullptr;
+            }
+
+            bool erase(Header header) {
+                auto index = static_cast<std::size_t>(header);
+                if (!Set(_present, index)) {
+                    return false;
+                }
+
+                _present &= static_cast<uint16_t>(~(1u << index));
+                _headers[index].clear();
+
+                return true;
+            }
+            bool erase(const std::string& key) {
+                auto index = HeaderIndex(key.data(), key.length());
+                if (index >= 0) {
+                    return erase(static_cast<Header>(index));
+                }
+
+                auto it = lowerBound(key);
+                if (it == _fields.end() || it->first != key) {
+                    return false;
+                }
+
+                _fields.erase(it);
+                return true;
+            }
+            void clear() {
+                for (std::size_t i = 0; i < HeaderCount; ++i) {
+                    _headers[i].clear();
+                }
+                _present = 0;
+                _fields.clear();
+            }
+
+            //Calls visit(key, value) for every pair, in key order
+            template <class Visitor>
+            void forEach(Visitor visit) const {
+                auto field = _fields.begin();
+
+                for (std::size_t i = 0; i < HeaderCount; ++i) {
+                    if (!Set(_present, i)) {
+                        continue;
+                    }
+
+                    auto& name = Name(static_cast<Header>(i));
+                    for (; field != _fields.end() && field->first < name; ++field) {
+                        visit(field->first, field->second);
+                    }
+
+                    visit(name, _headers[i]);
+                }
+
+                for (; field != _fields.end(); ++field) {
+                    visit(field->first, field->second);
+                }
+            }
+
+            std::map<std::string, std::string> toMap() const {
+                std::map<std::string, std::string> map;
+                forEach([&map](const std::string& key, const std::string& value) {
+                    map.emplace_hint(map.end(), key, value);
+                });
+
+                return map;
+            }
+            void assign(const std::map<std::string, std::string>& map) {
+                clear();
+                for (auto& pair : map) {
+                    (*this)[pair.first] = pair.second;
+                }
+            }
+        };
+
         class MessageBase: Base {
             friend class NodeBase;
             friend void SetMessageUIDLength(unsigned int);
             friend unsigned int GetMessageUIDLength();
-            std::map<std::string, std::string> _message_map;
+            //A received message keeps its buffer and only records where each
+            //key and value sits in it. Values are copied (and unescaped) when
+            //they are read; _fields is only filled once the message is
+            //modified.
+            struct View {
+                uint32_t key, key_length;
+                uint32_t value, value_length;
+                bool escaped; //Key or value holds an escape sequence
+            };
 
-        protected:
-            MessageBase() {
-                _message_map["uid"] = CallDLL::generateUID(UIDLength);
+            MessageFields _fields;
+            std::string _raw;
+            std::vector<View> _views;
+            int _header_views[MessageFields::HeaderCount] = {-1, -1, -1, -1, -1, -1, -1, -1, -1}; //Index of the view holding each header, or -1
+            static_assert(MessageFields::HeaderCount == 9, "_header_views needs a -1 for each header");
+            WireFormat _received_format = WireFormat::Text;
+            std::string _wire_advert; //"<version>@<client ID>" from a text message's wire-format key
+
+            //Writes a new UID over 'uid', reusing its buffer
+            static void GenerateUID(std::string& uid) {
+                uid.resize(9 * UIDLength);
+                uid.resize(CallDLL::generateUIDInto(UIDLength, &uid[0], static_cast<unsigned int>(uid.size())) - 1);
+            }
+            //Escapes 'text' onto the end of 'out'
+            static void AppendEncoded(std::string& out, const std::string& text) {
+                auto pos = out.length();
+                auto capacity = 2 * text.length() + 1;
+
+                out.resize(pos + capacity);
+                out.resize(pos + CallDLL::messageEncodeInto(text.data(), static_cast<unsigned int>(text.length()), &out[pos], static_cast<unsigned int>(capacity)) - 1);
             }
-            MessageBase(std::string& message): MessageBase() {
-                std::vector<std::string> lines;
 
-                //Ensure the first and last character is not an ampersand or whitespace, otherwise the below algorithm will error
-                while (message[0] == '&' || message[0] == ' ' || message[0] == '\t' || message[0] == '\n') {
-                    message.erase(message.begin());
+            static bool IsPadding(char c) {
+                return c == '&' || c == ' ' || c == '\t' || c == '\n';
+            }
+            static void DecodeInto(std::string& decoded, const char* data, std::size_t length, bool escaped) {
+                if (!escaped) {
+                    decoded.assign(data, length);
+                    return;
                 }
-                while (message[message.length() - 1] == '&' || message[message.length() - 1] == ' ' || message[message.length() - 1] == '\t' || message[message.length() - 1] == '\n') {
-                    message.erase(message.end() - 1);
+
+                decoded.clear();
+                for (std::size_t i = 0; i < length; ++i) {
+                    if (data[i] == '|' && i + 1 < length) {
+                        ++i;
+                    }
+                    decoded += data[i];
                 }
+            }
+            static std::string Decode(const char* data, std::size_t length, bool escaped) {
+                std::string decoded;
+                DecodeInto(decoded, data, length, escaped);
 
-                //Separate the string into lines based on the '&' character
-                std::string line;
-                unsigned i = 0, j = 0;
-                bool found = false;
-                for (; j < message.length(); ++j) { //Iterate over the string
-                    if (message[j] == '&') { //Finding all ampersnads
-                        found = true; //Used for lines.push_back condition
-                        if (message[j - 1] == '|') { //Check if it has been escaped
-                            continue;
-                        }
+                return decoded;
+            }
+
+            std::string viewKey(View const& view) const {
+                return Decode(_raw.data() + view.key, view.key_length, view.escaped);
+            }
+            std::string viewValue(View const& view) const {
+                return Decode(_raw.data() + view.value, view.value_length, view.escaped);
+            }
+            bool viewMatches(View const& view, std::string const& key) const {
+                if (!view.escaped) {
+                    return view.key_length == key.length() && memcmp(_raw.data() + view.key, key.data(), key.length()) == 0;
+                }
+
+                return viewKey(view) == key;
+            }
+            View const* findView(Header header) const {
+                if (_views.empty()) {
+                    return nullptr;
+                }
 
-                        if (i > 0) { //If it's not the first result
-                            line = message.substr(i + 1, j - i - 1);
-                        } else {
-                            line = message.substr(i, j - i);
+                auto index = _header_views[static_cast<std::size_t>(header)];
+                return index < 0 ? nullptr : &_views[index];
+            }
+            //Later views win, as later pairs overwrote earlier ones
+            View const* findView(std::string const& key) const {
+                if (_views.empty()) {
+                    return nullptr;
+                }
+
+                auto header = MessageFields::HeaderIndex(key.data(), key.length());
+                if (header >= 0) {
+                    return findView(static_cast<Header>(header));
+                }
+
+                for (auto i = _views.rbegin(); i != _views.rend(); ++i) {
+                    if (viewMatches(*i, key)) {
+                        return &*i;
+                    }
+                }
+
+                return nullptr;
+            }
+            void addView(std::size_t key, std::size_t key_length, std::size_t value, std::size_t value_length, bool escaped) {
+                View view;
+                view.key = static_cast<uint32_t>(key);
+                view.key_length = static_cast<uint32_t>(key_length);
+                view.value = static_cast<uint32_t>(value);
+                view.value_length = static_cast<uint32_t>(value_length);
+                view.escaped = escaped;
+                _views.push_back(view);
+            }
+
+            void indexViews() {
+                for (auto& index : _header_views) {
+                    index = -1;
+                }
+
+                for (std::size_t i = 0; i < _views.size(); ++i) {
+                    auto key = viewKey(_views[i]);
+                    auto header = MessageFields::HeaderIndex(key.data(), key.length());
+
+                    if (header >= 0) {
+                        _header_views[header] = static_cast<int>(i);
+                    }
+                }
+            }
+
+            //Folds the views into _fields and lets go of the buffer
+            void materialize() {
+                if (_views.empty() && _raw.empty()) {
+                    return;
+                }
+
+                for (auto& view : _views) {
+                    DecodeInto(_fields[viewKey(view)], _raw.data() + view.value, view.value_length, view.escaped);
+                }
+
+                _views.clear();
+                _raw.clear(); //Keeps the buffer for a pooled message's next use
+            }
+
+            void adopt(MessageBase const& msg) {
+                _fields = msg._fields;
+                _raw = msg._raw;
+                _views = msg._views;
+                std::copy(std::begin(msg._header_views), std::end(msg._header_views), _header_views);
+                _received_format = msg._received_format;
+            }
+            void adopt(MessageBase&& msg) {
+                _fields = std::move(msg._fields);
+                _raw = std::move(msg._raw);
+                _views = std::move(msg._views);
+                std::copy(std::begin(msg._header_views), std::end(msg._header_views), _header_views);
+                _received_format = msg._received_format;
+            }
+
+            void parseBinary() {
+                if (_raw.length() < 3 || static_cast<unsigned char>(_raw[2]) != Frame::BinaryVersion) {
+                    throw std::runtime_error("MessageBase - unsupported binary message version");
+                }
+
+                const char* begin = _raw.data();
+                const char* pos = begin + 3;
+                const char* end = begin + _raw.length();
+
+                while (pos < end) {
+                    auto key_length = Frame::ReadLength(pos, end);
+                    auto key = pos - begin;
+                    pos += key_length;
+
+                    auto value_length = Frame::ReadLength(pos, end);
+                    addView(key, key_length, pos - begin, value_length, false);
+                    pos += value_length;
+                }
+
+                _received_format = WireFormat::Binary;
+            }
+            void parseText() {
+                std::size_t begin = 0, end = _raw.length();
+
+                //Ampersands and whitespace around the message carry nothing
+                while (begin < end && IsPadding(_raw[begin])) {
+                    ++begin;
+                }
+                while (end > begin && IsPadding(_raw[end - 1])) {
+                    --end;
+                }
+
+                //Each pair ends at an unescaped '&' and is split at its first unescaped '='
+                std::size_t pair = begin, equals = std::string::npos;
+                bool escaped = false;
+                for (std::size_t i = begin; i <= end; ++i) {
+                    if (i < end && _raw[i] == '|') {
+                        escaped = true;
+                        ++i; //Skip the escaped character
+                        continue;
+                    }
+
+                    if (i == end || _raw[i] == '&') {
+                        if (i > pair) {
+                            if (equals == std::string::npos) {
+                                addView(pair, i - pair, i, 0, escaped);
+                            } else {
+                                addView(pair, equals - pair, equals + 1, i - equals - 1, escaped);
+                            }
                         }
 
-                        i = j;
+                        pair = i + 1;
+                        equals = std::string::npos;
+                        escaped = false;
+                    } else if (_raw[i] == '=' && equals == std::string::npos) {
+                        equals = i;
+                    }
+                }
 
-                        lines.push_back(line);
+                //Taken out so it never reaches the application
+                for (auto i = _views.begin(); i != _views.end(); ++i) {
+                    if (viewMatches(*i, "wire-format")) {
+                        _wire_advert = viewValue(*i);
+                        _views.erase(i);
+                        break;
                     }
                 }
-                if (found) {
-                    lines.push_back(message.substr(i + 1)); //Collect the segment after the last &
+            }
+            void parse() {
+                if (Frame::IsFrame(_raw.data(), _raw.length()) && _raw[1] == Frame::Binary) {
+                    parseBinary();
                 } else {
-                    lines.push_back(message); //No ampersand. Message is a singular variable
+                    parseText();
                 }
 
-                //Assign to the std::map
-                std::string key, value;
-                for (int k = 0; k < lines.size(); ++k) {
-                    //split name and value
-                    key = lines[k].substr(0, lines[k].find('='));
-                    value = lines[k].substr(lines[k].find('=') + 1);
-
-                    //assign to the std::map
-                    _message_map[CallDLL::messageDecode(key.c_str())] = CallDLL::messageDecode(value.c_str());
+                indexViews();
+                if (!findView(Header::UID)) {
+                    GenerateUID(_fields[Header::UID]);
                 }
             }
+
+        protected:
+            //Empties the message without giving up any buffers
+            void reset() {
+                _fields.clear();
+                _views.clear();
+                _raw.clear();
+                _received_format = WireFormat::Text;
+                _wire_advert.clear();
+            }
+            //Parses 'message' in place of the current contents. The buffers are
+            //swapped, so 'message' comes back holding the old one.
+            void parseFrom(std::string& message) {
+                reset();
+                _raw.swap(message);
+                parse();
+            }
+            void renewUID() {
+                materialize();
+                GenerateUID(_fields[Header::UID]);
+            }
+
+            MessageBase() {
+                GenerateUID(_fields[Header::UID]);
+            }
+            MessageBase(std::string& message): _raw(message) {
+                parse();
+            }
+            MessageBase(std::string&& message): _raw(std::move(message)) {
+                parse();
+            }
             MessageBase(std::map<std::string, std::string>& map) {
-                _message_map = map;
+                _fields.assign(map);
             }
             MessageBase(std::map<std::string, std::string>&& map) {
-                _message_map = map;
+                _fields.assign(map);
             }
             MessageBase(std::string& message, NodeBase* link): MessageBase(message) {
                 this->linkWithNode(link);
                 link->addLink(this);
             }
+            MessageBase(std::string&& message, NodeBase* link): MessageBase(std::move(message)) {
+                this->linkWithNode(link);
+                link->addLink(this);
+            }
             virtual void onDeletedNode() {
                 _node_link = nullptr;
             }
@@ -278,20 +1691,25 @@ namespace Sul {
             }
 
             NodeBase* _node_link = nullptr;
+            LinkHook<MessageBase> _node_hook; //Place in the list of _node_link
 
         public:
             MessageBase(MessageBase const& msg) {
                 _node_link = msg._node_link;
-                _node_link->addLink(this);
+                if (_node_link) {
+                    _node_link->addLink(this);
+                }
 
-                _message_map = msg._message_map;
+                adopt(msg);
             }
             MessageBase(MessageBase&& msg) {
                 _node_link = msg._node_link;
                 msg._node_link = nullptr;
-                _node_link->changeLink(&msg, this);
+                if (_node_link) {
+                    _node_link->changeLink(&msg, this);
+                }
 
-                _message_map = msg._message_map;
+                adopt(std::move(msg));
             }
             virtual ~MessageBase() {
                 if (_node_link) {
@@ -301,100 +1719,291 @@ namespace Sul {
             }
 
             MessageBase& operator=(MessageBase& msg) {
-                //Stay on the same node but adopt 'msg._message_map'
-                _message_map = msg._message_map;
+                //Stay on the same node but adopt the contents of 'msg'
+                adopt(msg);
                 return *this;
             }
             MessageBase& operator=(MessageBase&& msg) {
-                //Stay on the same node but adopt 'msg._message_map'
-                _message_map = msg._message_map;
+                //Stay on the same node but adopt the contents of 'msg'
+                adopt(std::move(msg));
                 return *this;
             }
             std::string& operator[](std::string& key) {
-                return _message_map[key];
+                materialize();
+                return _fields[key];
             }
             std::string& operator[](std::string&& key) {
-                return _message_map[key];
+                materialize();
+                return _fields[key];
+            }
+            std::string& operator[](Header header) {
+                materialize();
+                return _fields[header];
             }
 
             virtual void send() {
-                if (get("target") == "") {
+                if (get(Header::Target) == "") {
                     throw std::runtime_error("Message::send - must specify a target to send a message");
                 }
 
-                send(get("target"));
+                send(get(Header::Target));
             }
             virtual void send(std::string dest) {
                 if (!_node_link) {
                     throw std::runtime_error("Sul::Comms::MessageBase::sendTo - The node link no longer exists.");
                 }
 
-                (*this)["target"] = dest;
+                (*this)[Header::Target] = dest;
 
                 //Send to the destination mailslot by calling send() on _node_link;
                 _node_link->send(*this);
             }
             virtual void reply(MessageBase msg) {
-                msg["reply-to"] = _message_map["uid"];
-                msg["type"] = "reply";
-                msg["target"] = _message_map["sender"];
+                msg[Header::ReplyTo] = get(Header::UID);
+                msg[Header::Type] = "reply";
+                msg[Header::Target] = get(Header::Sender);
                 _node_link->send(msg);
             }
             virtual void reply(std::string msg) {
-                reply(MessageBase(msg));
+                reply(MessageBase(std::move(msg)));
             }
-            std::string get(std::string& key) const {
-                if (_message_map.find(key) == _message_map.end()) {
-                    return "";
+            std::string get(std::string const& key) const {
+                if (auto view = findView(key)) {
+                    return viewValue(*view);
                 }
 
-                return _message_map.at(key);
+                auto value = _fields.find(key);
+                return value ? *value : "";
             }
             std::string get(std::string&& key) const {
-                if (_message_map.find(key) == _message_map.end()) {
-                    return "";
+                return get(key);
+            }
+            std::string get(Header header) const {
+                if (auto view = findView(header)) {
+                    return viewValue(*view);
                 }
 
-                return _message_map.at(key);
+                auto value = _fields.find(header);
+                return value ? *value : "";
+            }
+            bool contains(std::string const& key) const {
+                return findView(key) || _fields.contains(key);
+            }
+            bool contains(Header header) const {
+                return findView(header) || _fields.find(header);
             }
-            std::map<std::string, std::string>& getMessageMap() {
-                return _message_map;
+            //Returns false if the key wasn't set
+            bool erase(std::string const& key) {
+                materialize();
+                return _fields.erase(key);
+            }
+            bool erase(Header header) {
+                materialize();
+                return _fields.erase(header);
+            }
+            //A const copy, so code that changed the map in place, which would
+            //now be lost, no longer compiles. Change the message through
+            //operator[], erase and setMessageMap.
+            const std::map<std::string, std::string> getMessageMap() const {
+                auto map = _fields.toMap();
+                for (auto& view : _views) {
+                    map[viewKey(view)] = viewValue(view);
+                }
+
+                return map;
             };
             std::string getMessage() {
-                //Explode the map into a string
-                std::string message = "";
-                for (auto i = _message_map.begin(), e = _message_map.end(); i != e; i++) {
-                    std::string first = CallDLL::messageEncode(i->first.c_str());
-                    std::string second = CallDLL::messageEncode(i->second.c_str());
-                    message += first + "=" + second;
+                std::string message;
+                appendMessage(message, WireFormat::Text);
 
-                    if (++i != e) {
-                        message += '&';
-                    }
-                    i--;
-                }
+                return message;
+            }
+            std::string getMessage(WireFormat format) {
+                std::string message;
+                appendMessage(message, format);
 
                 return message;
             }
+            //Encodes the message onto the end of 'message', so a caller can
+            //reuse one buffer for many messages
+            void appendMessage(std::string& message, WireFormat format) {
+                materialize();
+
+                if (format == WireFormat::Text) {
+                    //Explode the fields into a string
+                    auto start = message.length();
+                    _fields.forEach([&](const std::string& key, const std::string& value) {
+                        if (message.length() != start) {
+                            message += '&';
+                        }
+
+                        AppendEncoded(message, key);
+                        message += '=';
+                        AppendEncoded(message, value);
+                    });
+
+                    return;
+                }
+
+                std::size_t size = message.length() + 3;
+                _fields.forEach([&size](const std::string& key, const std::string& value) {
+                    size += 2 * sizeof(std::size_t) + key.length() + value.length();
+                });
+
+                message.reserve(size);
+                message += Frame::Marker;
+                message += Frame::Binary;
+                message += static_cast<char>(Frame::BinaryVersion);
+
+                _fields.forEach([&message](const std::string& key, const std::string& value) {
+                    Frame::AppendLength(message, key.length());
+                    message.append(key);
+                    Frame::AppendLength(message, value.length());
+                    message.append(value);
+                });
+            }
             void setMessageMap(std::map<std::string, std::string> map) {
-                _message_map = map;
+                _views.clear();
+                _raw.clear();
+                _fields.assign(map);
             }
 
             static unsigned int UIDLength;
         };
 
         void NodeBase::send(MessageBase& msg, std::string mailslot_prefix) {
-            if (msg.getMessageMap().find("target") == msg.getMessageMap().end()) {
+            if (!msg.contains(Header::Target)) {
                 throw std::runtime_error("NodeBase::send - The message cannot be sent without a target");
             }
 
-            msg["sender"] = _client_id;
-            auto dest = mailslot_prefix + msg["target"];
-            CallDLL::send(msg.getMessage().c_str(), dest.c_str());
+            msg[Header::Sender] = _client_id;
+            auto dest = mailslot_prefix + msg[Header::Target];
+            auto& data = encodeFor(msg);
+            write(data, dest, 1);
+        }
+        void NodeBase::sendBatch(std::vector<MessageBase*>& msgs, std::string mailslot_prefix) {
+            //Group by target, keeping the order within each group
+            std::map<std::string, std::vector<MessageBase*>> groups;
+            for (auto msg : msgs) {
+                if (!msg->contains(Header::Target)) {
+                    throw std::runtime_error("NodeBase::sendBatch - The message cannot be sent without a target");
+                }
+
+                groups[(*msg)[Header::Target]].push_back(msg);
+            }
+
+            for (auto& group : groups) {
+                auto dest = mailslot_prefix + group.first;
+
+                if (group.second.size() == 1) {
+                    send(*group.second[0], mailslot_prefix);
+                    continue;
+                }
+
+                std::string frame;
+                std::size_t framed = 0;
+                for (auto msg : group.second) {
+                    (*msg)[Header::Sender] = _client_id;
+                    Frame::AppendToBatch(frame, encodeFor(*msg));
+                    framed++;
+
+                    if (frame.length() >= Frame::MaxBatchSize) {
+                        write(frame, dest, framed);
+                        frame.clear();
+                        framed = 0;
+                    }
+                }
+
+                if (!frame.empty()) {
+                    write(frame, dest, framed);
+                }
+            }
+        }
+        //Text messages carry an advert of the newest format this node reads,
+        //tagged with its ID so a forwarding peer can't pass it off as its own.
+        //The result lives in a buffer of the calling thread's until its next
+        //call, so nodes can send from several threads at once.
+        const std::string& NodeBase::encodeFor(MessageBase& msg) {
+            static thread_local std::string scratch; //Only grows
+            auto format = std::min(_wire_format, getPeerWireFormat(msg[Header::Target]));
+
+            scratch.clear();
+            msg.appendMessage(scratch, format);
+
+            if (format == WireFormat::Text && _wire_format != WireFormat::Text) {
+                scratch += "&wire-format=";
+                MessageBase::AppendEncoded(scratch, std::to_string(static_cast<unsigned int>(_wire_format)) + "@" + _client_id);
+            }
+
+            return scratch;
+        }
+        void NodeBase::learnWireFormat(MessageBase& msg) {
+            if (_wire_format == WireFormat::Text) {
+                return;
+            }
+
+            auto sender = msg.get(Header::Sender);
+            std::lock_guard<std::mutex> guard(_peer_lock);
+            if (msg._received_format != WireFormat::Text) {
+                setPeerWireFormat(sender, std::min(_wire_format, msg._received_format));
+                return;
+            }
+
+            //Peers can send anything, so adverts that aren't a known format
+            //followed by the sender's own ID are ignored
+            auto& advert = msg._wire_advert;
+            auto at = advert.find('@');
+            if (at == std::string::npos || at == 0 || at > 3 || advert.compare(at + 1, std::string::npos, sender) != 0) {
+                return;
+            }
+
+            unsigned int version = 0;
+            for (std::size_t i = 0; i < at; ++i) {
+                if (advert[i] < '0' || advert[i] > '9') {
+                    return;
+                }
+                version = version * 10 + (advert[i] - '0');
+            }
+
+            if (version <= static_cast<unsigned int>(WireFormat::Binary)) {
+                setPeerWireFormat(sender, std::min(_wire_format, static_cast<WireFormat>(version)));
+            }
+        }
+        void NodeBase::onDeletedMessage(MessageBase* msg) {
+            std::lock_guard<std::mutex> guard(_link_lock);
+            if (!Links<MessageBase, &MessageBase::_node_hook>::Remove(_msg_links, msg)) {
+                throw std::runtime_error("Sul::Comms::NodeBase::onDeletedMessage - the given pointer was not part of the message list");
+            }
+        }
+        void NodeBase::addLink(MessageBase* link) {
+            std::lock_guard<std::mutex> guard(_link_lock);
+            Links<MessageBase, &MessageBase::_node_hook>::Push(_msg_links, link); //Linking twice is harmless
+        }
+        void NodeBase::changeLink(MessageBase* prev_msg, MessageBase* new_msg) {
+            std::lock_guard<std::mutex> guard(_link_lock);
+            if (!Links<MessageBase, &MessageBase::_node_hook>::Replace(_msg_links, prev_msg, new_msg)) {
+                throw std::runtime_error("Sul::Comms::NodeBase::changeLink - the given pointer to be replaced was not part of the message list");
+            }
+        }
+        //Takes over the messages linked to 'node'
+        void NodeBase::adoptLinks(NodeBase& node) {
+            std::lock_guard<std::mutex> guard(node._link_lock);
+            _msg_links = node._msg_links;
+            node._msg_links = nullptr;
+
+            Links<MessageBase, &MessageBase::_node_hook>::ForEach(_msg_links, [this](MessageBase* msg) {
+                msg->linkWithNode(this);
+            });
         }
         NodeBase::~NodeBase() {
-            for (int i = 0; i < _msg_links.size(); ++i) {
-                _msg_links[i]->onDeletedNode();
+            std::unique_lock<std::mutex> guard(_link_lock);
+            Links<MessageBase, &MessageBase::_node_hook>::Clear(_msg_links, [](MessageBase* msg) {
+                msg->onDeletedNode();
+            });
+            guard.unlock();
+
+            if (_slot_handle) {
+                CallDLL::closeNode(_slot_handle);
             }
         }
 
@@ -404,6 +2013,16 @@ namespace Sul {
         unsigned int GetMessageUIDLength() {
             return MessageBase::UIDLength;
         }
+        //128 random bits from the generator behind message UIDs, as 16 raw
+        //bytes. Binary messages can carry it as is.
+        std::string GenerateBinaryUID() {
+            Base base; //Loads the DLL if no node has yet
+
+            std::string uid(16, '\0');
+            Base::CallDLL::generateUIDBinary(reinterpret_cast<unsigned char*>(&uid[0]), static_cast<unsigned int>(uid.size()));
+
+            return uid;
+        }
 
         class LocalNode: public NodeBase {
         public:
@@ -416,7 +2035,7 @@ namespace Sul {
             protected:
                 Message(): MessageBase() {}
                 Message(std::string& str): MessageBase(str) {}
-                Message(std::string&& str): MessageBase(str) {}
+                Message(std::string&& str): MessageBase(std::move(str)) {}
                 Message(std::map<std::string, std::string>& map): MessageBase(map) {}
                 Message(std::map<std::string, std::string>&& map): MessageBase(map) {}
 
@@ -426,23 +2045,21 @@ namespace Sul {
             };
 
             Message getNextMessage() {
-                auto ret = Message(baseGetNextMessage());
+                auto data = baseGetNextMessage();
+                auto start = std::chrono::steady_clock::now();
+                auto ret = Message(std::move(data));
                 ret.linkWithNode(this);
                 this->addLink(&ret);
+                learnWireFormat(ret);
+                countParse(start);
                 return ret;
             }
             Message waitForMessage() {
                 return waitForMessage(0); //No timeout
             }
             Message waitForMessage(std::size_t timeout) {
-                std::size_t ms_count = 0;
-                while (!hasNewMessages()) {
-                    Sleep(20);
-                    ms_count += 20;
-
-                    if (timeout > 0 && ms_count > timeout) {
-                        throw std::runtime_error("waitForMessage - Operation timed out.");
-                    }
+                if (!awaitNewMessages(timeout)) {
+                    throw std::runtime_error("waitForMessage - Operation timed out.");
                 }
 
                 return getNextMessage();
@@ -451,6 +2068,13 @@ namespace Sul {
             virtual void send(MessageBase& msg) {
                 NodeBase::send(msg, "\\\\.\\mailslot\\" + Prefix);
             }
+            virtual void sendBatch(std::vector<MessageBase*>& msgs) {
+                NodeBase::sendBatch(msgs, "\\\\.\\mailslot\\" + Prefix);
+            }
+            template <class Iterator>
+            void sendBatch(Iterator first, Iterator last) {
+                NodeBase::sendBatch(first, last);
+            }
 
             //Initializer can be l or r value refs to string or map
             template <class Init>
@@ -458,14 +2082,14 @@ namespace Sul {
                 auto msg = Message(initializer);
                 msg.linkWithNode(this);
                 this->addLink(&msg); //The link is tracked across move/copy constructors
-                msg["scope"] = "local";
+                msg[Header::Scope] = "local";
                 return msg;
             }
             Message createMessage() {
                 auto msg = Message();
                 msg.linkWithNode(this);
                 this->addLink(&msg); //The link is tracked across move/copy constructors
-                msg["scope"] = "local";
+                msg[Header::Scope] = "local";
                 return msg;
             }
         };
@@ -482,7 +2106,7 @@ namespace Sul {
             protected:
                 Message(): MessageBase() {}
                 Message(std::string& str): MessageBase(str) {}
-                Message(std::string&& str): MessageBase(str) {}
+                Message(std::string&& str): MessageBase(std::move(str)) {}
                 Message(std::map<std::string, std::string>& map): MessageBase(map) {}
                 Message(std::map<std::string, std::string>&& map): MessageBase(map) {}
 
@@ -492,23 +2116,21 @@ namespace Sul {
             };
 
             Message getNextMessage() {
-                auto ret = Message(baseGetNextMessage());
+                auto data = baseGetNextMessage();
+                auto start = std::chrono::steady_clock::now();
+                auto ret = Message(std::move(data));
                 ret.linkWithNode(this);
                 this->addLink(&ret);
+                learnWireFormat(ret);
+                countParse(start);
                 return ret;
             }
             Message waitForMessage() {
                 return waitForMessage(0); //No timeout
             }
             Message waitForMessage(std::size_t timeout) {
-                std::size_t ms_count = 0;
-                while (!hasNewMessages()) {
-                    Sleep(20);
-                    ms_count += 20;
-
-                    if (timeout > 0 && ms_count > timeout) {
-                        throw std::runtime_error("waitForMessage - Operation timed out.");
-                    }
+                if (!awaitNewMessages(timeout)) {
+                    throw std::runtime_error("waitForMessage - Operation timed out.");
                 }
 
                 return getNextMessage();
@@ -520,14 +2142,14 @@ namespace Sul {
                 auto msg = Message(initializer);
                 msg.linkWithNode(this);
                 this->addLink(&msg); //The link is tracked across move/copy constructors
-                msg["scope"] = "remote";
+                msg[Header::Scope] = "remote";
                 return msg;
             }
             Message createMessage() {
                 auto msg = Message();
                 msg.linkWithNode(this);
                 this->addLink(&msg); //The link is tracked across move/copy constructors
-                msg["scope"] = "remote";
+                msg[Header::Scope] = "remote";
                 return msg;
             }
 
@@ -543,6 +2165,13 @@ namespace Sul {
             virtual void send(MessageBase& msg) {
                 NodeBase::send(msg, "\\\\*\\mailslot\\" + Prefix);
             }
+            virtual void sendBatch(std::vector<MessageBase*>& msgs) {
+                NodeBase::sendBatch(msgs, "\\\\*\\mailslot\\" + Prefix);
+            }
+            template <class Iterator>
+            void sendBatch(Iterator first, Iterator last) {
+                NodeBase::sendBatch(first, last);
+            }
         };
 
         std::string NodeBase::Prefix = "";
@@ -558,10 +2187,10 @@ namespace Sul {
             protected:
                 Message(): MessageBase() {}
                 Message(std::string& str): MessageBase(str) {}
-                Message(std::string&& str): MessageBase(str) {}
+                Message(std::string&& str): MessageBase(std::move(str)) {}
                 Message(std::map<std::string, std::string>& map): MessageBase(map) {}
                 Message(std::map<std::string, std::string>&& map): MessageBase(map) {}
-                Message(std::string& str, NodeBase* nlink, ServerBase* slink): MessageBase(str, nlink) {
+                Message(std::string&& str, NodeBase* nlink, ServerBase* slink): MessageBase(std::move(str), nlink) {
                     linkWithServer(slink);
                     slink->addLink(this);
                 }
@@ -574,22 +2203,26 @@ namespace Sul {
                     _server_link = server;
                 }
 
-                virtual void onDeletedNode() {
+                virtual void onDeletedServer() {
                     _server_link = nullptr;
-                    MessageBase::onDeletedNode();
                 }
 
                 ServerBase* _server_link = nullptr;
+                LinkHook<Message> _server_hook; //Place in the list of _server_link
 
             public:
                 Message(Message const& msg): MessageBase(msg) {
                     _server_link = msg._server_link;
-                    _server_link->addLink(this);
+                    if (_server_link) {
+                        _server_link->addLink(this);
+                    }
                 }
-                Message(Message&& msg): MessageBase(msg) {
+                Message(Message&& msg): MessageBase(std::move(msg)) {
                     _server_link = msg._server_link;
                     msg._server_link = nullptr;
-                    _server_link->changeLink(&msg, this);
+                    if (_server_link) {
+                        _server_link->changeLink(&msg, this);
+                    }
                 }
                 virtual ~Message() {
                     if (_server_link) {
@@ -599,70 +2232,231 @@ namespace Sul {
                 }
 
                 Message& operator=(Message const& msg) {
-                    this->setMessageMap((*const_cast<Message*>(&msg)).getMessageMap());
+                    this->setMessageMap(msg.getMessageMap());
                     return *this;
                 }
 
+                //The first reply to this message goes to onReply, or to onError
+                //if its status is "error"; the handlers are dropped after it
                 void onReply(std::function<void(MessageBase&)> fn) {
-                    _server_link->setReceiveEvent(Event([this](MessageBase const& msg) -> bool {
-                        //Capture any replies directed at this message, that are NOT errors
-                        return msg.get("type") == "reply" && msg.get("reply-to") == (*this)["uid"] && msg.get("status") != "error";
-                    }), fn);
+                    _server_link->expectReply(get(Header::UID), fn, false);
                 }
 
                 void onError(std::function<void(MessageBase&)> fn) {
-                    _server_link->setReceiveEvent(Event([this](MessageBase const& msg) -> bool {
-                        //Capture any replies directed at this message, that ARE errors
-                        return msg.get("type") == "reply" && msg.get("reply-to") == (*this)["uid"] && msg.get("status") == "error";
-                    }), fn);
+                    _server_link->expectReply(get(Header::UID), fn, true);
+                }
+
+                //Called if no reply has arrived 'timeout' ms from now, in place
+                //of the server's default reply timeout
+                void onTimeout(std::size_t timeout, std::function<void()> fn) {
+                    _server_link->expectTimeout(get(Header::UID), timeout, fn);
                 }
 
                 virtual void send() override {
-                    if (get("target") == "") {
+                    if (get(Header::Target) == "") {
                         throw std::runtime_error("Message::send - must specify a target to send a message");
                     }
 
-                    send(get("target"));
+                    send(get(Header::Target));
                 }
                 virtual void send(std::string dest) override {
-                    (*this)["target"] = dest;
+                    (*this)[Header::Target] = dest;
 
                     _server_link->processOutgoingMessage(*this);
 
                     MessageBase::send(dest);
                 }
                 virtual void reply(std::string msg) {
-                    reply(Message(msg, _node_link, _server_link));
+                    auto resp = _server_link->acquireBlank();
+                    resp->parseFrom(msg);
+
+                    replyWith(*resp);
                 }
                 virtual void reply(Message msg) {
-                    msg["reply-to"] = get("uid");
-                    msg["type"] = "reply";
-                    msg["target"] = get("sender");
-
-                    msg.send();
+                    replyWith(msg);
                 }
                 virtual void replyError(Message msg) {
-                    msg["status"] = "error";
+                    msg[Header::Status] = "error";
                     reply(msg);
                 }
                 virtual void replyError(std::string msg) {
-                    Message resp;
-                    resp.linkWithServer(this->_server_link);
-                    resp.linkWithNode(this->_node_link);
-                    this->_server_link->addLink(&resp);
-                    this->_node_link->addLink(&resp);
+                    auto resp = _server_link->acquireBlank();
+                    (*resp)[Header::Status] = "error";
+                    (*resp)["msg"] = msg;
 
-                    resp["status"] = "error";
-                    resp["msg"] = msg;
+                    replyWith(*resp);
+                }
+
+            protected:
+                void replyWith(Message& msg) {
+                    msg[Header::ReplyTo] = get(Header::UID);
+                    msg[Header::Type] = "reply";
+                    msg[Header::Target] = get(Header::Sender);
 
-                    reply(resp);
+                    msg.send();
                 }
             };
             friend class Message;
 
+            //Recycles messages, and the buffers inside them, for the server's
+            //own temporaries and for callers using acquireMessage and
+            //receiveMessage. Pooled messages stay linked to the server and
+            //node for their whole life, so handing one out costs no linking.
+            class MessagePool {
+                friend class ServerBase;
+
+                std::vector<std::unique_ptr<Message>> _messages;
+                std::vector<Message*> _free;
+                MessagePoolStats _stats;
+                std::mutex _lock;
+
+                //nullptr if every message is in use
+                Message* take() {
+                    std::lock_guard<std::mutex> guard(_lock);
+                    _stats.acquired++;
+
+                    if (_free.empty()) {
+                        return nullptr;
+                    }
+
+                    auto msg = _free.back();
+                    _free.pop_back();
+                    _stats.reused++;
+                    track();
+
+                    return msg;
+                }
+                Message* add(Message* msg) {
+                    std::lock_guard<std::mutex> guard(_lock);
+                    _messages.emplace_back(msg);
+                    _stats.capacity = _messages.size();
+                    track();
+
+                    return msg;
+                }
+                void track() {
+                    _stats.inUse = _messages.size() - _free.size();
+                    _stats.peak = std::max(_stats.peak, _stats.inUse);
+                }
+
+            public:
+                void release(Message* msg) {
+                    msg->reset();
+
+                    std::lock_guard<std::mutex> guard(_lock);
+                    _free.push_back(msg);
+                    track();
+                }
+
+                MessagePoolStats stats() {
+                    std::lock_guard<std::mutex> guard(_lock);
+                    return _stats;
+                }
+            };
+
+            //Owns a pooled message and gives it back when it goes out of scope.
+            //Must not outlive the server.
+            class PooledMessage {
+                MessagePool* _pool = nullptr;
+                Message* _msg = nullptr;
+
+            public:
+                PooledMessage() {}
+                PooledMessage(MessagePool* pool, Message* msg): _pool(pool), _msg(msg) {}
+                PooledMessage(PooledMessage&& other): _pool(other._pool), _msg(other._msg) {
+                    other._msg = nullptr;
+                }
+                PooledMessage(PooledMessage const&) = delete;
+                ~PooledMessage() {
+                    release();
+                }
+
+                PooledMessage& operator=(PooledMessage&& other) {
+                    if (this != &other) {
+                        release();
+                        _pool = other._pool;
+                        _msg = other._msg;
+                        other._msg = nullptr;
+                    }
+
+                    return *this;
+                }
+                PooledMessage& operator=(PooledMessage const&) = delete;
+
+                Message* operator->() const {
+                    return _msg;
+                }
+                Message& operator*() const {
+                    return *_msg;
+                }
+                Message* get() const {
+                    return _msg;
+                }
+                explicit operator bool() const {
+                    return _msg != nullptr;
+                }
+
+                void release() {
+                    if (_msg) {
+                        _pool->release(_msg);
+                        _msg = nullptr;
+                    }
+                }
+            };
+
+            class EventTable;
+
             class Event {
+                friend class EventTable;
+
                 std::function<bool(MessageBase const&)> _condition;
                 std::function<void(MessageBase&)> _handler;
+                std::string _key; //Set if the condition is a header match
+                std::string _value;
+                bool _mutating = false; //The handler changes the message
+
+                //Each copy of an event counts its own calls
+                struct Counters {
+                    std::atomic<unsigned long long> calls{0};
+                    std::atomic<unsigned long long> matches{0};
+                    std::atomic<unsigned long long> nanos{0};
+
+                    Counters() {}
+                    Counters(Counters const&) {}
+                    Counters& operator=(Counters const&) {
+                        return *this;
+                    }
+                } _counters;
+
+                //Set by the table on removal, so a dispatch already holding
+                //the event skips it
+                struct Removed {
+                    std::atomic<bool> value{false};
+
+                    Removed() {}
+                    Removed(Removed const&) {}
+                    Removed& operator=(Removed const&) {
+                        return *this;
+                    }
+                } _removed;
+
+                void count(bool matched, std::chrono::steady_clock::time_point start) {
+                    _counters.calls.fetch_add(1, std::memory_order_relaxed);
+                    _counters.matches.fetch_add(matched ? 1 : 0, std::memory_order_relaxed);
+                    _counters.nanos.fetch_add(std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now() - start).count(), std::memory_order_relaxed);
+                }
+                bool call(MessageBase& msg) {
+                    if (!_handler) {
+                        return _condition(msg);
+                    }
+
+                    if (_condition(msg)) {
+                        _handler(msg);
+                        return true;
+                    }
+
+                    return false;
+                }
 
             public:
                 Event() {
@@ -673,43 +2467,225 @@ namespace Sul {
                 //Event(bool(*cd)(MessageBase const&)): _condition(cd) {}
                 Event(std::function<bool(MessageBase const&)> cd): _condition(cd) {}
                 Event(std::function<bool(MessageBase const&)> cd, std::function<bool(MessageBase&)> hn): _condition(cd), _handler(hn) {}
+                //Matches messages where 'key' is set to 'value'. The server
+                //indexes these, so they cost nothing for other messages.
+                Event(std::string key, std::string value): _key(key), _value(value) {
+                    _condition = [key, value](MessageBase const& msg) -> bool {
+                        return msg.get(key) == value;
+                    };
+                }
+                Event(Header header, std::string value): _key(MessageFields::Name(header)), _value(value) {
+                    _condition = [header, value](MessageBase const& msg) -> bool {
+                        return msg.get(header) == value;
+                    };
+                }
 
                 void setCondition(std::function<bool(MessageBase const&)> fn) {
                     _condition = fn;
+                    _key.clear();
+                }
+                bool isMatch() const {
+                    return !_key.empty();
+                }
+                std::string const& key() const {
+                    return _key;
+                }
+                std::string const& value() const {
+                    return _value;
                 }
                 void setHandler(std::function<void(MessageBase&)> fn) {
                     _handler = fn;
                 }
+                //Marks the handler as one that changes the message. With a
+                //worker pool, such handlers run one at a time on the
+                //dispatching thread before the rest are handed out, and the
+                //rest each get a copy of the message, so changes made by them
+                //stay with that copy.
+                void setMutating(bool mutating) {
+                    _mutating = mutating;
+                }
+                bool isMutating() const {
+                    return _mutating;
+                }
 
                 bool operator()(MessageBase& msg) {
-                    if (!_handler) {
-                        return _condition(msg);
+                    auto start = std::chrono::steady_clock::now();
+                    bool matched;
+                    try {
+                        matched = call(msg);
+                    } catch (...) {
+                        count(true, start); //Only a handler throws
+                        throw;
                     }
+                    count(matched, start);
 
-                    if (_condition(msg)) {
-                        _handler(msg);
-                        return true;
+                    return matched;
+                }
+                bool removed() const {
+                    return _removed.value.load(std::memory_order_acquire);
+                }
+                EventStats stats() const {
+                    EventStats stats;
+                    stats.calls = _counters.calls.load(std::memory_order_relaxed);
+                    stats.matches = _counters.matches.load(std::memory_order_relaxed);
+                    stats.nanos = _counters.nanos.load(std::memory_order_relaxed);
+
+                    return stats;
+                }
+            };
+
+            //Events by ID, which is also their registration order. Header
+            //match events are indexed by key and value, so for a given
+            //message only those it matches and the events with arbitrary
+            //conditions are tried.
+            class EventTable {
+            public:
+                typedef std::pair<std::size_t, std::shared_ptr<Event>> Entry; //ID and event
+
+            private:
+                std::map<std::size_t, std::shared_ptr<Event>> _events;
+                std::unordered_map<std::string, std::unordered_map<std::string, std::vector<Entry>>> _index;
+                std::vector<Entry> _unindexed;
+                std::size_t _count = 0;
+                std::mutex _lock; //Events can be added and removed while listen() threads dispatch
+
+                static bool Before(Entry const& entry, std::size_t id) {
+                    return entry.first < id;
+                }
+                static bool Earlier(Entry const& a, Entry const& b) {
+                    return a.first < b.first;
+                }
+                static void Erase(std::vector<Entry>& entries, std::size_t id) {
+                    auto found = std::lower_bound(entries.begin(), entries.end(), id, Before);
+                    if (found != entries.end() && found->first == id) {
+                        entries.erase(found);
                     }
+                }
 
-                    return false;
+            public:
+                std::size_t add(Event evt) {
+                    std::lock_guard<std::mutex> guard(_lock);
+                    std::size_t id = _count++;
+                    auto added = std::make_shared<Event>(evt);
+                    if (added->isMatch()) {
+                        _index[added->key()][added->value()].emplace_back(id, added);
+                    } else {
+                        _unindexed.emplace_back(id, added);
+                    }
+                    _events[id] = added;
+
+                    return id;
+                }
+                void remove(std::size_t id) {
+                    std::lock_guard<std::mutex> guard(_lock);
+                    auto evt = _events.find(id);
+                    if (evt == _events.end()) {
+                        return;
+                    }
+
+                    if (evt->second->isMatch()) {
+                        auto& values = _index[evt->second->key()];
+                        auto& ids = values[evt->second->value()];
+                        Erase(ids, id);
+                        if (ids.empty()) {
+                            values.erase(evt->second->value());
+                        }
+                        if (values.empty()) {
+                            _index.erase(evt->second->key());
+                        }
+                    } else {
+                        Erase(_unindexed, id);
+                    }
+                    evt->second->_removed.value.store(true, std::memory_order_release);
+                    _events.erase(evt);
+                }
+                //Fills 'out' with the events 'msg' may match, in registration
+                //order
+                void candidates(MessageBase const& msg, std::vector<Entry>& out) {
+                    std::lock_guard<std::mutex> guard(_lock);
+                    out.assign(_unindexed.begin(), _unindexed.end());
+                    bool merged = false;
+
+                    for (auto& key : _index) {
+                        auto entries = key.second.find(msg.get(key.first));
+                        if (entries != key.second.end()) {
+                            merged = merged || !out.empty();
+                            out.insert(out.end(), entries->second.begin(), entries->second.end());
+                        }
+                    }
+
+                    if (merged) {
+                        std::sort(out.begin(), out.end(), Earlier);
+                    }
+                }
+                void stats(std::map<std::size_t, EventStats>& out) {
+                    std::lock_guard<std::mutex> guard(_lock);
+                    for (auto& evt : _events) {
+                        out[evt.first] = evt.second->stats();
+                    }
                 }
             };
 
         private:
+            //Borrows the calling thread's candidate buffer, so dispatch doesn't
+            //allocate. A handler that dispatches again, e.g. by sending, finds
+            //it lent out and starts a buffer of its own.
+            struct Candidates {
+                std::vector<EventTable::Entry> list;
+
+                Candidates() {
+                    list.swap(Spare());
+                }
+                ~Candidates() {
+                    list.clear(); //Don't keep removed events alive
+                    if (list.capacity() > Spare().capacity()) {
+                        list.swap(Spare());
+                    }
+                }
+
+                static std::vector<EventTable::Entry>& Spare() {
+                    static thread_local std::vector<EventTable::Entry> spare;
+                    return spare;
+                }
+            };
+
             std::function<void(std::function<void()>)> _workerAllocProc;
             std::function<int()> _workerCheckProc;
+            std::shared_ptr<Threading::WorkerPool> _workers;
             bool _workerAllocImplemented = false;
             bool _workerCheckImplemented = false;
-            std::map<std::size_t, Event> _receive_event_handlers;
-            std::map<std::size_t, Event> _send_event_handlers;
-            std::size_t _receive_evt_count = 0;
-            std::size_t _send_evt_count = 0;
+            EventTable _receive_event_handlers;
+            EventTable _send_event_handlers;
+
+            typedef std::chrono::steady_clock::time_point Deadline;
+
+            //Handlers waiting on the reply to a sent message
+            struct PendingReply {
+                std::function<void(MessageBase&)> reply;
+                std::function<void(MessageBase&)> error;
+                std::function<void()> timeout;
+                std::multimap<Deadline, std::string>::iterator deadline;
+                bool expires = false;
+            };
+            std::unordered_map<std::string, PendingReply> _pending_replies; //By UID of the sent message
+            std::multimap<Deadline, std::string> _reply_deadlines; //UIDs, soonest first
+            std::size_t _reply_timeout = 0; //ms; 0 for none. Guarded by _pending_lock.
+            std::mutex _pending_lock;
             std::size_t _default_ping_event;
             std::size_t _default_forward_event;
-            std::vector<Message> _message_queue;
+            MessagePool _pool;
+            RingQueue<PooledMessage> _message_queue; //Received messages put aside, e.g. by ping; after _pool so it is destroyed first
+            std::map<std::string, std::pair<PingStats, Latency::Rolling>> _ping_stats; //By target
+            std::chrono::milliseconds _ping_window{60000};
+            std::mutex _ping_lock;
+            std::function<void(std::string const&)> _stats_log; //Set by logStatsEvery
+            std::chrono::milliseconds _stats_interval{0};
+            Deadline _stats_due;
+            std::mutex _stats_log_lock;
             bool _ping_overwritten = false;
             bool _forward_overwritten = false;
-            bool _listening = false;
+            std::atomic<bool> _listening{false};
+            std::atomic<std::thread::id> _listen_thread; //Receiving for listen()
 
         protected:
             NodeBase* _node;
@@ -724,95 +2700,250 @@ namespace Sul {
                 };
 
                 //Define default event handlers
-                _default_ping_event = setReceiveEvent(Event([](MessageBase const& msg) -> bool {
-                    return msg.get("type") == "ping";
-                }), [](MessageBase& msg) {
+                _default_ping_event = setReceiveEvent(Event(Header::Type, "ping"), [](MessageBase& msg) {
                     msg.reply("response=ok");
                 });
 
-                _default_forward_event = setReceiveEvent(Event([](MessageBase const& msg) -> bool {
-                    return msg.get("action") == "forward";
-                }), [](MessageBase& msg) {
-                    auto fw_target = msg["forward-to"];
-                    msg.getMessageMap().erase("action");
-                    msg.getMessageMap().erase("forward-to");
+                Event forward(Header::Action, "forward");
+                forward.setMutating(true);
+                _default_forward_event = setReceiveEvent(forward, [](MessageBase& msg) {
+                    auto fw_target = msg[Header::ForwardTo];
+                    msg.erase(Header::Action);
+                    msg.erase(Header::ForwardTo);
+
+                    msg["forwarded-for"] = msg[Header::Sender];
+                    msg.send(fw_target);
+                });
+            }
+
+            ServerBase(ServerBase&) {
+                throw std::runtime_error("ServerBase(ServerBase&) is not implemented");
+            }
+            ServerBase& operator=(ServerBase&) {
+                throw std::runtime_error("ServerBase& operator=(ServerBase&) is not implemented");
+            }
+
+            void processIncomingMessage(MessageBase& msg) {
+                dispatchReply(msg);
+                runReceiveEvents(msg);
+            }
+            //As above, for a message whose reply handlers have already run
+            void runReceiveEvents(MessageBase& msg) {
+                expireReplies();
+
+                runEvents(_receive_event_handlers, msg);
+            }
+            void processOutgoingMessage(MessageBase& msg) {
+                runEvents(_send_event_handlers, msg);
+            }
+            //Runs the events in 'table' that match 'msg', on the worker pool
+            //or the worker allocation procedure if either is set, and returns
+            //once all of them have finished. The first exception thrown by a
+            //handler is rethrown here.
+            //
+            //Handlers sharing a message would race, as even reading a field
+            //through operator[] writes to it. Mutating events therefore run
+            //here first, in order, and each of the others gets its own copy.
+            void runEvents(EventTable& table, MessageBase& msg) {
+                Candidates candidates;
+                table.candidates(msg, candidates.list);
+
+                auto workers = _workers;
+                if (!workers && !_workerAllocImplemented) {
+                    for (auto& entry : candidates.list) {
+                        if (!entry.second->removed()) { //Unless removed by an earlier handler
+                            (*entry.second)(msg);
+                        }
+                    }
+
+                    return;
+                }
+
+                std::size_t parallel = 0;
+                for (auto& entry : candidates.list) {
+                    if (entry.second->removed()) {
+                        continue;
+                    }
+
+                    if (entry.second->isMutating()) {
+                        (*entry.second)(msg);
+                    } else {
+                        candidates.list[parallel++] = entry;
+                    }
+                }
+                candidates.list.resize(parallel);
+
+                //A lone handler can have the message itself
+                std::vector<PooledMessage> copies;
+                if (parallel > 1) {
+                    copies.reserve(parallel);
+                    for (std::size_t i = 0; i < parallel; ++i) {
+                        copies.push_back(acquireClean());
+                        static_cast<MessageBase&>(*copies.back()) = msg;
+                    }
+                }
+
+                Threading::Latch done(parallel);
+                std::exception_ptr error;
+                std::mutex error_lock;
+
+                for (std::size_t i = 0; i < parallel; ++i) {
+                    auto evt = candidates.list[i].second;
+                    MessageBase* target = copies.empty() ? &msg : copies[i].get();
+
+                    auto fn = [evt, target, &done, &error, &error_lock]() {
+                        try {
+                            (*evt)(*target);
+                        } catch (...) {
+                            std::lock_guard<std::mutex> guard(error_lock);
+                            if (!error) {
+                                error = std::current_exception();
+                            }
+                        }
+                        done.countDown();
+                    };
+
+                    //If there are no threads available, or no defined way to allocate work, do the work on this thread
+                    if (workers) {
+                        workers->submit(fn);
+                    } else if (_workerCheckProc() > 1) {
+                        _workerAllocProc(fn);
+                    } else {
+                        fn();
+                    }
+                }
+
+                //Block the thread until all handlers have finished
+                if (workers) {
+                    workers->wait(done);
+                } else {
+                    done.wait();
+                }
+
+                if (error) {
+                    std::rethrow_exception(error);
+                }
+            }
+
+            //Entry for 'uid', created with the default deadline if there is
+            //none. '_pending_lock' must be held.
+            PendingReply& pendingReply(std::string const& uid) {
+                auto found = _pending_replies.find(uid);
+                if (found != _pending_replies.end()) {
+                    return found->second;
+                }
+
+                auto& pending = _pending_replies[uid];
+                if (_reply_timeout) {
+                    setDeadline(pending, uid, _reply_timeout);
+                }
+
+                return pending;
+            }
+            void setDeadline(PendingReply& pending, std::string const& uid, std::size_t timeout) {
+                if (pending.expires) {
+                    _reply_deadlines.erase(pending.deadline);
+                }
+
+                pending.deadline = _reply_deadlines.emplace(std::chrono::steady_clock::now() + std::chrono::milliseconds(timeout), uid);
+                pending.expires = true;
 
-                    msg["forwarded-for"] = msg["sender"];
-                    msg.send(fw_target);
-                });
+                //listen() may be waiting without a timeout
+                if (pending.deadline == _reply_deadlines.begin() && _listening) {
+                    _node->wake();
+                }
             }
+            void expectReply(std::string const& uid, std::function<void(MessageBase&)> fn, bool error) {
+                std::lock_guard<std::mutex> guard(_pending_lock);
+                auto& pending = pendingReply(uid);
 
-            ServerBase(ServerBase&) {
-                throw std::runtime_error("ServerBase(ServerBase&) is not implemented");
+                (error ? pending.error : pending.reply) = fn;
             }
-            ServerBase& operator=(ServerBase&) {
-                throw std::runtime_error("ServerBase& operator=(ServerBase&) is not implemented");
+            void expectTimeout(std::string const& uid, std::size_t timeout, std::function<void()> fn) {
+                std::lock_guard<std::mutex> guard(_pending_lock);
+                auto& pending = pendingReply(uid);
+
+                pending.timeout = fn;
+                setDeadline(pending, uid, timeout);
             }
+            //Hands a reply to the handlers waiting on it. Returns false if
+            //'msg' is not a reply anything is waiting on.
+            bool dispatchReply(MessageBase& msg) {
+                if (msg.get(Header::Type) != "reply") {
+                    return false;
+                }
 
-            void processIncomingMessage(MessageBase& msg) {
-                int process_count = 0;
-                for (auto it = _receive_event_handlers.begin(); it != _receive_event_handlers.end(); it++) {
-                    process_count++;
-                    auto fn = [it, &msg, &process_count](){
-                        it->second(msg);
-                        process_count--;
-                    };
+                PendingReply pending;
+                {
+                    std::lock_guard<std::mutex> guard(_pending_lock);
+                    auto found = _pending_replies.find(msg.get(Header::ReplyTo));
+                    if (found == _pending_replies.end()) {
+                        return false;
+                    }
 
-                    //If there are no threads available, or no defined way to allocate work, do the work on this thread
-                    if (_workerAllocImplemented && _workerCheckProc() > 1) {
-                        _workerAllocProc(fn);
-                    } else {
-                        fn();
+                    if (found->second.expires) {
+                        _reply_deadlines.erase(found->second.deadline);
                     }
+                    pending = std::move(found->second);
+                    _pending_replies.erase(found);
                 }
 
-                //Block the thread until all processes have finished
-                while (process_count > 0) {
-                    Sleep(10);
+                auto& fn = msg.get(Header::Status) == "error" ? pending.error : pending.reply;
+                if (fn) {
+                    fn(msg);
                 }
-            }
-            void processOutgoingMessage(MessageBase& msg) {
-                int process_count = 0;
-                for (auto it = _send_event_handlers.begin(); it != _send_event_handlers.end(); it++) {
-                    process_count++;
-                    auto fn = [it, &msg, &process_count](){
-                        it->second(msg);
-                        process_count--;
-                    };
 
-                    if (_workerAllocImplemented && _workerCheckProc() > 1) {
-                        _workerAllocProc(fn);
-                    } else {
-                        fn();
-                    }
+                return true;
+            }
+            //ms until the next reply deadline, capped at 'max'. A 'max' of 0
+            //is no cap, and 0 comes back if there is no deadline either.
+            std::size_t untilNextDeadline(std::size_t max) {
+                std::lock_guard<std::mutex> guard(_pending_lock);
+                if (_reply_deadlines.empty()) {
+                    return max;
                 }
 
-                //Block the thread until all processes have finished
-                while (process_count > 0) {
-                    Sleep(10);
+                auto left = std::chrono::duration_cast<std::chrono::milliseconds>(_reply_deadlines.begin()->first - std::chrono::steady_clock::now()).count() + 1;
+                if (left < 1) {
+                    return 1;
                 }
+
+                return max ? std::min(max, static_cast<std::size_t>(left)) : static_cast<std::size_t>(left);
             }
 
         public:
             ServerBase(ServerBase&& server) {
+                std::unique_lock<std::mutex> link_guard(server._link_lock);
                 _node = server._node;
                 server._node = nullptr;
                 _msg_links = server._msg_links;
-
-                //To avoid the messages being deleted
-                server._msg_links.erase(server._msg_links.begin(), server._msg_links.end() - 1);
-
-                //Change the message links to this node
-                for (int i = 0; i < _msg_links.size(); ++i) {
-                    _msg_links[i]->linkWithServer(this);
-                    //Don't need to link with node. Node is being transferred
-                    //so it will be the same
-                }
+                server._msg_links = nullptr;
+                link_guard.unlock();
+
+                //Pooled messages are among the links, so they move too. Those
+                //put aside go back to the pool first.
+                server._message_queue.clear();
+                std::lock_guard<std::mutex> guard(server._pool._lock);
+                _pool._messages = std::move(server._pool._messages);
+                _pool._free = std::move(server._pool._free);
+                _pool._stats = server._pool._stats;
+
+                std::lock_guard<std::mutex> pending_guard(server._pending_lock);
+                _pending_replies = std::move(server._pending_replies);
+                _reply_deadlines = std::move(server._reply_deadlines);
+                _reply_timeout = server._reply_timeout;
+
+                //Change the message links to this server. Don't need to link
+                //with node. Node is being transferred so it will be the same
+                ServerLinks::ForEach(_msg_links, [this](Message* msg) {
+                    msg->linkWithServer(this);
+                });
             }
             virtual ~ServerBase() {
-                for (int i = 0; i < _msg_links.size(); ++i) {
-                    _msg_links[i]->onDeletedNode();
-                }
+                std::lock_guard<std::mutex> guard(_link_lock);
+                ServerLinks::Clear(_msg_links, [](Message* msg) {
+                    msg->onDeletedServer();
+                });
             }
 
             void setWorkerAllocationProc(std::function<void(std::function<void()>)> fn) {
@@ -823,20 +2954,31 @@ namespace Sul {
                 _workerCheckProc = fn; //Should return the number of free worker threads
                 _workerCheckImplemented = true;
             }
+            //Runs event handlers on 'pool', which may be shared between
+            //servers. Takes precedence over the worker procedures; nullptr
+            //goes back to them. Handlers running in parallel each see their
+            //own copy of the message; see Event::setMutating.
+            void setWorkerPool(std::shared_ptr<Threading::WorkerPool> pool) {
+                _workers = pool;
+            }
+            //Runs event handlers on a pool of 'threads' threads of this
+            //server's own
+            void useWorkerPool(std::size_t threads) {
+                setWorkerPool(std::make_shared<Threading::WorkerPool>(threads));
+            }
+            std::shared_ptr<Threading::WorkerPool> getWorkerPool() {
+                return _workers;
+            }
             std::size_t onPing(std::function<void(MessageBase&)> fn) {
                 if (!_ping_overwritten) {
                     _ping_overwritten = true;
                     removeReceiveEvent(_default_ping_event);
                 }
 
-                return setReceiveEvent(Event([](MessageBase const& msg) -> bool {
-                    return msg.get("type") == "ping";
-                }), fn);
+                return setReceiveEvent(Event(Header::Type, "ping"), fn);
             }
             std::size_t onExternalError(std::function<void(MessageBase&)> fn) {
-                return setReceiveEvent(Event([](MessageBase const& msg) -> bool {
-                    return msg.get("status") == "error";
-                }), fn);
+                return setReceiveEvent(Event(Header::Status, "error"), fn);
             }
             std::size_t onForwardRequest(std::function<void(MessageBase&)> fn) {
                 if (!_forward_overwritten) {
@@ -844,9 +2986,14 @@ namespace Sul {
                     removeReceiveEvent(_default_forward_event);
                 }
 
-                return setReceiveEvent(Event([](MessageBase const& msg) -> bool {
-                    return msg.get("action") == "forward";
-                }), fn);
+                return setReceiveEvent(Event(Header::Action, "forward"), fn);
+            }
+            //Handles messages where 'key' is set to 'value'
+            std::size_t onMatch(std::string key, std::string value, std::function<void(MessageBase&)> fn) {
+                return setReceiveEvent(Event(key, value), fn);
+            }
+            std::size_t onMatch(Header header, std::string value, std::function<void(MessageBase&)> fn) {
+                return setReceiveEvent(Event(header, value), fn);
             }
             std::size_t onMessageReceived(std::function<void(MessageBase&)> fn) {
                 return setReceiveEvent(Event([](MessageBase const& msg) {
@@ -859,78 +3006,334 @@ namespace Sul {
                 }), fn);
             }
             std::size_t setProxy(std::string clientID) {
-                return setSendEvent(Event([](MessageBase const& msg) -> bool {
+                Event proxy([](MessageBase const& msg) -> bool {
                     return true;
-                }), [clientID](MessageBase& msg) {
-                    msg["forward-to"] = msg["target"];
-                    msg["target"] = clientID;
+                });
+                proxy.setMutating(true);
+                return setSendEvent(proxy, [clientID](MessageBase& msg) {
+                    msg[Header::ForwardTo] = msg[Header::Target];
+                    msg[Header::Target] = clientID;
                 });
             }
             void removeProxy(std::size_t proxyID) {
                 removeSendEvent(proxyID);
             }
             std::size_t setReceiveEvent(Event cd, std::function<void(MessageBase&)> hd) {
-                std::size_t it = _receive_evt_count++;
                 cd.setHandler(hd);
-                _receive_event_handlers[it] = cd;
-
-                return it;
+                return _receive_event_handlers.add(cd);
             }
             std::size_t setSendEvent(Event cd, std::function<void(MessageBase&)> hd) {
-                std::size_t it = _send_evt_count++;
                 cd.setHandler(hd);
-                _send_event_handlers[it] = cd;
-
-                return it;
+                return _send_event_handlers.add(cd);
             }
             void removeReceiveEvent(std::size_t evtID) {
-                _receive_event_handlers.erase(evtID);
+                _receive_event_handlers.remove(evtID);
             }
             void removeSendEvent(std::size_t evtID) {
-                _send_event_handlers.erase(evtID);
+                _send_event_handlers.remove(evtID);
+            }
+            //Deadline, in ms, given to replies expected through onReply or
+            //onError from now on, unless onTimeout sets one. 0 (the default)
+            //waits forever.
+            void setReplyTimeout(std::size_t timeout) {
+                std::lock_guard<std::mutex> guard(_pending_lock);
+                _reply_timeout = timeout;
+            }
+            //Drops the expected replies whose deadline has passed, calling
+            //their timeout handlers. Done on each message received and each
+            //listen() wake, so only needed when neither is happening.
+            //Returns the number dropped.
+            std::size_t expireReplies() {
+                std::vector<std::function<void()>> expired;
+                {
+                    std::lock_guard<std::mutex> guard(_pending_lock);
+                    auto now = std::chrono::steady_clock::now();
+
+                    while (!_reply_deadlines.empty() && _reply_deadlines.begin()->first <= now) {
+                        auto found = _pending_replies.find(_reply_deadlines.begin()->second);
+                        expired.push_back(std::move(found->second.timeout));
+                        _pending_replies.erase(found);
+                        _reply_deadlines.erase(_reply_deadlines.begin());
+                    }
+                }
+
+                for (auto& fn : expired) {
+                    if (fn) {
+                        fn();
+                    }
+                }
+
+                return expired.size();
+            }
+            std::size_t pendingReplyCount() {
+                std::lock_guard<std::mutex> guard(_pending_lock);
+                return _pending_replies.size();
+            }
+            //Stops waiting for the reply to the message with UID 'uid'; none
+            //of its handlers will be called. Returns false if nothing was.
+            bool cancelReply(std::string const& uid) {
+                std::lock_guard<std::mutex> guard(_pending_lock);
+                auto found = _pending_replies.find(uid);
+                if (found == _pending_replies.end()) {
+                    return false;
+                }
+
+                if (found->second.expires) {
+                    _reply_deadlines.erase(found->second.deadline);
+                }
+                _pending_replies.erase(found);
+
+                return true;
+            }
+            //Sends 'msg' and returns a future for its reply, error replies
+            //included. If no reply arrives within 'timeout' ms (0 for the
+            //server's reply timeout) the future holds an exception instead.
+            //Replies are picked up by whatever is receiving on this server,
+            //normally listen() on another thread, so any number of requests
+            //can be outstanding without a thread waiting on each.
+            std::future<Message> request(Message& msg, std::size_t timeout) {
+                auto promise = std::make_shared<std::promise<Message>>();
+                auto uid = msg.get(Header::UID);
+
+                auto fulfil = [this, promise](MessageBase& reply) {
+                    auto copy = linkedMessage();
+                    static_cast<MessageBase&>(copy) = reply;
+
+                    promise->set_value(std::move(copy));
+                };
+
+                {
+                    //Registered before sending so a quick reply can't be missed
+                    std::lock_guard<std::mutex> guard(_pending_lock);
+                    auto& pending = pendingReply(uid);
+                    pending.reply = fulfil;
+                    pending.error = fulfil;
+                    pending.timeout = [promise]() {
+                        promise->set_exception(std::make_exception_ptr(std::runtime_error("ServerBase::request - no reply before the timeout")));
+                    };
+                    if (timeout) {
+                        setDeadline(pending, uid, timeout);
+                    }
+                }
+
+                try {
+                    msg.send();
+                } catch (...) {
+                    cancelReply(uid);
+                    throw;
+                }
+
+                return promise->get_future();
+            }
+            std::future<Message> request(Message& msg) {
+                return request(msg, 0); //The server's reply timeout
+            }
+            //Runs the send events on each message in [first, last), then hands
+            //them to the node to go out as one write per target
+            template <class Iterator>
+            void sendBatch(Iterator first, Iterator last) {
+                std::vector<MessageBase*> msgs;
+                for (; first != last; ++first) {
+                    Message& msg = *first;
+                    if (msg.get(Header::Target) == "") {
+                        throw std::runtime_error("Server::sendBatch - must specify a target to send a message");
+                    }
+
+                    processOutgoingMessage(msg);
+                    msgs.push_back(&msg);
+                }
+
+                _node->sendBatch(msgs);
             }
             Message getNextMessage() {
                 return getNextMessage(false); //Do not ignore the local queue
             }
             Message getNextMessage(bool ignoreLocalQueue) {
-                Message ret; //Create a new empty message
-                ret.linkWithNode(_node);
-                ret.linkWithServer(this);
-                addLink(&ret);
-                _node->addLink(&ret);
-
-                if (!ignoreLocalQueue && _message_queue.size() > 1) {
-                    ret.setMessageMap(_message_queue[0].getMessageMap());
-                    _message_queue.erase(_message_queue.begin());
+                auto ret = linkedMessage();
+                PooledMessage queued;
+
+                if (!ignoreLocalQueue && _message_queue.pop(queued)) {
+                    static_cast<MessageBase&>(ret) = std::move(*queued);
                 } else {
-                    ret.setMessageMap((Message(_node->baseGetNextMessage())).getMessageMap());
+                    auto data = _node->baseGetNextMessage();
+                    auto start = std::chrono::steady_clock::now();
+                    Message received(std::move(data));
+                    _node->learnWireFormat(received);
+                    _node->countParse(start);
+                    static_cast<MessageBase&>(ret) = std::move(received);
                 }
 
-                ret.linkWithNode(_node);
-                ret.linkWithServer(this);
-                _node->addLink(&ret);
-                this->addLink(&ret);
-
                 processIncomingMessage(ret);
 
                 return ret;
             }
+            //Moves up to 'max' waiting messages into 'out', local queue first,
+            //running the receive events on each. Whatever the transport holds
+            //is taken with a single read. Returns the number added.
+            std::size_t getNextMessages(std::size_t max, std::vector<Message>& out) {
+                std::size_t added = 0;
+                out.reserve(out.size() + max);
+
+                PooledMessage queued;
+                while (added < max && _message_queue.pop(queued)) {
+                    out.push_back(linkedMessage());
+                    static_cast<MessageBase&>(out.back()) = std::move(*queued);
+                    processIncomingMessage(out.back());
+                    added++;
+                }
+
+                if (added < max && _node->_unpacked.size() < max - added) {
+                    _node->drainTransport(max - added - _node->_unpacked.size());
+                }
+
+                while (added < max && !_node->_unpacked.empty()) {
+                    auto data = _node->baseGetNextMessage();
+                    auto start = std::chrono::steady_clock::now();
+                    out.push_back(Message(std::move(data), _node, this));
+                    _node->learnWireFormat(out.back());
+                    _node->countParse(start);
+                    processIncomingMessage(out.back());
+                    added++;
+                }
+
+                return added;
+            }
             Message waitForMessage() {
                 return waitForMessage(0); //No timeout
             }
             Message waitForMessage(std::size_t timeout) {
-                std::size_t ms_count = 0;
-                while (!_node->hasNewMessages()) {
-                    Sleep(20);
-                    ms_count += 20;
-
-                    if (timeout > 0 && ms_count > timeout) {
-                        throw std::runtime_error("waitForMessage - Operation timed out.");
-                    }
+                if (!_node->awaitNewMessages(timeout)) {
+                    throw std::runtime_error("waitForMessage - Operation timed out.");
                 }
 
                 return getNextMessage();
             }
+            //A message from the pool, set up as createMessage would
+            PooledMessage acquireMessage() {
+                auto msg = acquireBlank();
+                (*msg)[Header::Scope] = scope();
+
+                return msg;
+            }
+            //As getNextMessage, but into a pooled message
+            PooledMessage receiveMessage() {
+                return receiveMessage(false); //Do not ignore the local queue
+            }
+            PooledMessage receiveMessage(bool ignoreLocalQueue) {
+                PooledMessage msg;
+
+                if (ignoreLocalQueue || !_message_queue.pop(msg)) {
+                    msg = acquireClean();
+                    readFromNode(*msg);
+                }
+
+                processIncomingMessage(*msg);
+
+                return msg;
+            }
+            //As waitForMessage, but into a pooled message
+            PooledMessage awaitMessage(std::size_t timeout) {
+                if (!_node->awaitNewMessages(timeout)) {
+                    throw std::runtime_error("awaitMessage - Operation timed out.");
+                }
+
+                return receiveMessage();
+            }
+            MessagePoolStats getMessagePoolStats() {
+                return _pool.stats();
+            }
+            //Bounds the queue of received messages put aside for later
+            //getNextMessage calls, such as those ping() reads past
+            void setQueueOptions(QueueOptions options) {
+                _message_queue.configure(options);
+            }
+            QueueStats getQueueStats() {
+                return _message_queue.stats();
+            }
+            void setReassemblyOptions(ReassemblyOptions options) {
+                _node->setReassemblyOptions(options);
+            }
+            void setCompressionThreshold(std::size_t bytes) {
+                _node->setCompressionThreshold(bytes);
+            }
+            ReassemblyStats getReassemblyStats() {
+                return _node->getReassemblyStats();
+            }
+            ServerStats getStats() {
+                ServerStats stats;
+                stats.node = _node->getStats();
+                stats.queued = _message_queue.size();
+                stats.pendingReplies = pendingReplyCount();
+                stats.reassembly = _node->getReassemblyStats();
+                _receive_event_handlers.stats(stats.receiveEvents);
+                _send_event_handlers.stats(stats.sendEvents);
+
+                return stats;
+            }
+            //One line of 'key=value' pairs, events as 'receive-<id>=calls/matches/ns'
+            static std::string FormatStats(std::string const& id, ServerStats const& stats) {
+                std::string line = "server=" + id;
+                auto add = [&line](std::string const& key, unsigned long long value) {
+                    line += " " + key + "=" + std::to_string(value);
+                };
+
+                add("sent", stats.node.sent);
+                add("sent-bytes", stats.node.sentBytes);
+                add("received", stats.node.received);
+                add("received-bytes", stats.node.receivedBytes);
+                add("send-errors", stats.node.sendErrors);
+                add("rejected", stats.node.rejected);
+                add("parsed", stats.node.parsed);
+                add("parse-ns", stats.node.parseNanos);
+                add("compressed", stats.node.compressed);
+                add("compressed-in", stats.node.compressedIn);
+                add("compressed-out", stats.node.compressedOut);
+                add("compress-ns", stats.node.compressNanos);
+                add("decompressed", stats.node.decompressed);
+                add("decompress-ns", stats.node.decompressNanos);
+                add("queued", stats.queued);
+                add("pending-replies", stats.pendingReplies);
+                add("fragments", stats.reassembly.fragments);
+                add("reassembled", stats.reassembly.completed);
+                add("reassembly-dropped", stats.reassembly.expired + stats.reassembly.evicted + stats.reassembly.rejected);
+
+                for (auto& evt : stats.receiveEvents) {
+                    line += " receive-" + std::to_string(evt.first) + "=" + std::to_string(evt.second.calls) + "/" + std::to_string(evt.second.matches) + "/" + std::to_string(evt.second.nanos);
+                }
+                for (auto& evt : stats.sendEvents) {
+                    line += " send-" + std::to_string(evt.first) + "=" + std::to_string(evt.second.calls) + "/" + std::to_string(evt.second.matches) + "/" + std::to_string(evt.second.nanos);
+                }
+
+                return line;
+            }
+            //Writes a FormatStats line to 'log' every 'ms' ms from listen().
+            //'log' is anything with log(std::string), such as a
+            //FileSystem::LogFile, and must stay alive until stopLoggingStats
+            //or the server is destroyed.
+            template <class Log>
+            void logStatsEvery(Log& log, std::size_t ms) {
+                std::lock_guard<std::mutex> guard(_stats_log_lock);
+                _stats_log = [&log](std::string const& line) {
+                    log.log(line);
+                };
+                _stats_interval = std::chrono::milliseconds(ms ? ms : 1);
+                _stats_due = std::chrono::steady_clock::now() + _stats_interval;
+
+                if (_listening) {
+                    _node->wake(); //So listen() picks up the new deadline
+                }
+            }
+            void stopLoggingStats() {
+                std::lock_guard<std::mutex> guard(_stats_log_lock);
+                _stats_log = nullptr;
+            }
+            //Grows the pool to at least 'count' messages up front
+            void reserveMessages(std::size_t count) {
+                std::vector<PooledMessage> held;
+                while (_pool.stats().capacity < count) {
+                    held.push_back(acquireClean());
+                }
+            }
             std::string getCliendID() {
                 return _node->getCliendID();
             }
@@ -953,64 +3356,282 @@ namespace Sul {
             bool hasNewMessages(bool ignoreLocalQueue) {
                 return numNewMessages(ignoreLocalQueue) > 0;
             }
+            //Round trip time in ms, rounded up to at least 1; 0 if no reply
+            //came within 'timeout' ms (0 waits indefinitely)
             std::size_t ping(std::string target) {
                 return ping(target, 2000); //2s timeout
             }
             std::size_t ping(std::string target, std::size_t timeout) {
-                return ping(target, timeout, 10); //10ms accuracy
+                auto time = pingTime(target, timeout);
+                if (time.count() == 0) {
+                    return 0;
+                }
+
+                return static_cast<std::size_t>(std::max<long long>(1, std::chrono::duration_cast<std::chrono::milliseconds>(time + std::chrono::microseconds(500)).count()));
             }
+            //Waiting now blocks on the node rather than polling, so 'accuracy'
+            //is unused; kept for existing callers
             std::size_t ping(std::string target, std::size_t timeout, std::size_t accuracy) {
                 if (accuracy == 0) {
                     throw std::runtime_error("Server::ping - Accuracy must be at least 1");
                 }
 
-                Message msgPing;
-                msgPing.linkWithNode(_node);
-                msgPing.linkWithServer(this);
-                _node->addLink(&msgPing);
-                this->addLink(&msgPing);
-
-                msgPing["type"] = "ping";
-                bool response = false;
-                auto c = clock();
-                clock_t duration;
-                msgPing.send(target);
-
-                std::size_t time_tally = 0;
-                while (!response) {
-                    //Check newest messages
-                    while (hasNewMessages(true)) { //Ignoring the local queue
-                        auto msg = getNextMessage(true); //Get next message, ignoring the local queue to avoid infinite loops
-                        if (msg["type"] == "reply" && msg["reply-to"] == msgPing["uid"]) {
-                            response = true;
-                            duration = clock() - c;
-                        } else {
-                            _message_queue.push_back(msg);
+                return ping(target, timeout);
+            }
+            //As ping, but at the steady clock's resolution; zero if no reply
+            //came within 'timeout' ms
+            std::chrono::nanoseconds pingTime(std::string target, std::size_t timeout) {
+                return pingMany(std::vector<std::string>{target}, timeout)[target];
+            }
+            std::map<std::string, std::chrono::nanoseconds> pingMany(std::vector<std::string> const& targets) {
+                return pingMany(targets, 2000); //2s timeout
+            }
+            //Pings every target at once and waits up to 'timeout' ms (0 waits
+            //indefinitely) for all of them. Returns the round trip time to
+            //each target, zero for those that didn't reply in time. While
+            //listen() runs on another thread the replies are picked up there,
+            //as for request(); otherwise they are read here, and messages
+            //that aren't ping replies are put aside for getNextMessage.
+            std::map<std::string, std::chrono::nanoseconds> pingMany(std::vector<std::string> const& targets, std::size_t timeout) {
+                typedef std::chrono::steady_clock Clock;
+
+                if (_listening && std::this_thread::get_id() != _listen_thread.load()) {
+                    return pingThroughListener(targets, timeout);
+                }
+
+                std::map<std::string, std::chrono::nanoseconds> times;
+                std::unordered_map<std::string, std::pair<std::string, Clock::time_point>> waiting; //Target and send time by ping UID
+
+                for (auto& target : targets) {
+                    if (!times.emplace(target, std::chrono::nanoseconds::zero()).second) {
+                        continue; //Pinged once however often it's listed
+                    }
+
+                    auto msgPing = acquireBlank();
+                    (*msgPing)[Header::Type] = "ping";
+                    auto& sent = waiting[msgPing->get(Header::UID)];
+                    sent.first = target;
+                    sent.second = Clock::now();
+                    msgPing->send(target);
+                }
+                countPings(times);
+
+                auto deadline = Clock::now() + std::chrono::milliseconds(timeout);
+                while (!waiting.empty()) {
+                    if (!_node->hasNewMessages()) {
+                        std::size_t remaining = 0;
+                        if (timeout > 0) {
+                            auto now = Clock::now();
+                            if (now >= deadline) {
+                                break;
+                            }
+
+                            remaining = static_cast<std::size_t>(std::chrono::duration_cast<std::chrono::milliseconds>(deadline - now).count() + 1);
                         }
+
+                        _node->waitForNewMessages(remaining);
+                        continue;
                     }
 
-                    Sleep(accuracy);
+                    //Read straight off the node, so the receive events run
+                    //once, when the message is taken from the local queue
+                    auto msg = acquireClean();
+                    readFromNode(*msg);
+                    auto arrived = Clock::now();
 
-                    time_tally += accuracy;
-                    if (timeout > 0 && time_tally >= timeout) {
-                        return 0;
+                    auto found = msg->get(Header::Type) == "reply" ? waiting.find(msg->get(Header::ReplyTo)) : waiting.end();
+                    if (found == waiting.end()) {
+                        _message_queue.push(std::move(msg));
+                        continue;
                     }
+
+                    auto time = std::chrono::duration_cast<std::chrono::nanoseconds>(arrived - found->second.second);
+                    times[found->second.first] = time;
+                    recordPing(found->second.first, time);
+                    waiting.erase(found);
+                }
+
+                for (auto& lost : waiting) {
+                    recordPing(lost.second.first, std::chrono::nanoseconds::zero());
                 }
 
-                return static_cast<std::size_t>(round(((double)(duration) / CLOCKS_PER_SEC) * 1000)); //Get the milliseconds taken
+                return times;
             }
-            void listen() {
-                listen(20); //Default 20ms interval
+            //Round trip times to 'target' over the ping window
+            PingStats getPingStats(std::string const& target) {
+                std::lock_guard<std::mutex> guard(_ping_lock);
+                auto found = _ping_stats.find(target);
+                if (found == _ping_stats.end()) {
+                    return PingStats();
+                }
+
+                auto stats = found->second.first;
+                stats.latency = found->second.second.summary();
+
+                return stats;
+            }
+            //As above, for every target pinged
+            std::map<std::string, PingStats> getPingStats() {
+                std::lock_guard<std::mutex> guard(_ping_lock);
+                std::map<std::string, PingStats> all;
+                for (auto& target : _ping_stats) {
+                    auto& stats = all[target.first] = target.second.first;
+                    stats.latency = target.second.second.summary();
+                }
+
+                return all;
+            }
+            //Sets how far back the latency percentiles look; clears them
+            void setPingWindow(std::size_t ms) {
+                std::lock_guard<std::mutex> guard(_ping_lock);
+                _ping_window = std::chrono::milliseconds(ms);
+                for (auto& target : _ping_stats) {
+                    target.second.second = Latency::Rolling(_ping_window, 6);
+                }
+            }
+            void resetPingStats() {
+                std::lock_guard<std::mutex> guard(_ping_lock);
+                _ping_stats.clear();
             }
+            void listen() {
+                listen(0); //Only wakes for messages, deadlines and stopListening
+            }
+            //Blocks on the node between messages, waking only when a message
+            //arrives, a reply or stats deadline is due or stopListening is
+            //called. On POSIX an idle server doesn't wake at all; mailslots
+            //can't be waited on, so on Windows it checks its slot at most
+            //every 20 ms once idle. A non-zero 'interval' caps each wait at
+            //that many ms.
             void listen(std::size_t interval) {
+                std::vector<Message> batch;
+
                 _listening = true;
+                _listen_thread = std::this_thread::get_id();
                 while (_listening) {
-                    while (!_node->hasNewMessages()) {
-                        Sleep(interval);
+                    auto wait = untilNextDeadline(logStatsIfDue(interval));
+                    if (_message_queue.empty() && !_node->waitForNewMessages(wait)) {
+                        expireReplies();
+                        continue;
                     }
 
-                    getNextMessage(); //Doesn't return the message.
+                    //Bursts are taken in one read; the messages aren't returned.
                     //Note: When using 'listen', it's expected that the programmer defines an 'onMessageReceived' event to handle the message
+                    batch.clear();
+                    getNextMessages(ListenBatchSize, batch);
+                }
+            }
+
+            //Receives on the calling thread and runs the receive events on
+            //'options.threads' dispatch threads. Messages are sharded by
+            //sender, so each sender's messages are handled in the order they
+            //arrived while different senders are handled in parallel.
+            //Receive events may run on any dispatch thread. Reply handlers
+            //run on the receiving thread, so a receive event can wait on a
+            //reply without holding it up. If a handler throws, or receiving
+            //does, listening stops and the exception is rethrown here once
+            //the dispatch threads have finished.
+            void listen(ListenOptions const& options) {
+                std::size_t threads = options.threads ? options.threads : std::max(1u, std::thread::hardware_concurrency());
+                std::size_t limit = std::max<std::size_t>(1, options.queueLimit);
+                std::vector<std::unique_ptr<ListenShard>> shards;
+
+                if (options.receiverCpu >= 0 && !Threading::PinCurrentThread(static_cast<unsigned int>(options.receiverCpu))) {
+                    throw std::runtime_error("ServerBase::listen - could not pin the receiving thread to CPU " + std::to_string(options.receiverCpu));
+                }
+
+                _listening = true;
+                _listen_thread = std::this_thread::get_id();
+                for (std::size_t i = 0; i < threads; ++i) {
+                    shards.emplace_back(new ListenShard());
+                }
+
+                Threading::Latch pinned(threads);
+                for (std::size_t i = 0; i < threads; ++i) {
+                    auto shard = shards[i].get();
+                    int cpu = options.cpus.empty() ? -1 : static_cast<int>(options.cpus[i % options.cpus.size()]);
+
+                    shard->thread = std::thread([this, shard, cpu, &pinned]() {
+                        if (cpu >= 0 && !Threading::PinCurrentThread(static_cast<unsigned int>(cpu))) {
+                            shard->unpinned = cpu;
+                        }
+                        pinned.countDown();
+                        dispatchShard(*shard);
+                    });
+                }
+
+                //Replies are matched here rather than on the shards, so a
+                //handler waiting on one never holds up its own reply
+                auto handOut = [this, &shards, limit](PooledMessage msg) {
+                    dispatchReply(*msg);
+
+                    auto& shard = *shards[std::hash<std::string>()(msg->get(Header::Sender)) % shards.size()];
+                    std::unique_lock<std::mutex> guard(shard.lock);
+                    shard.changed.wait(guard, [this, &shard, limit]() {
+                        return shard.messages.size() < limit || !_listening;
+                    });
+                    shard.messages.push_back(std::move(msg));
+                    guard.unlock();
+                    shard.changed.notify_all();
+                };
+
+                //A dispatch thread that couldn't be pinned stops listening
+                //before anything is received
+                std::exception_ptr error;
+                pinned.wait();
+                for (auto& shard : shards) {
+                    if (shard->unpinned >= 0) {
+                        error = std::make_exception_ptr(std::runtime_error("ServerBase::listen - could not pin a dispatch thread to CPU " + std::to_string(shard->unpinned)));
+                        _listening = false;
+                        break;
+                    }
+                }
+
+                //If receiving throws, the dispatch threads are still stopped
+                //and joined before the exception is rethrown
+                try {
+                    while (_listening) {
+                        //Messages put aside, e.g. by ping, go before newer ones
+                        PooledMessage queued;
+                        while (_message_queue.pop(queued)) {
+                            handOut(std::move(queued));
+                        }
+
+                        if (!_node->waitForNewMessages(untilNextDeadline(logStatsIfDue(options.interval)))) {
+                            expireReplies();
+                            continue;
+                        }
+
+                        if (_node->_unpacked.size() < ListenBatchSize) {
+                            _node->drainTransport(ListenBatchSize - _node->_unpacked.size());
+                        }
+
+                        while (!_node->_unpacked.empty()) {
+                            auto msg = acquireClean();
+                            readFromNode(*msg);
+                            handOut(std::move(msg));
+                        }
+                    }
+                } catch (...) {
+                    error = std::current_exception();
+                    _listening = false;
+                }
+
+                //Messages already handed out are still dispatched
+                for (auto& shard : shards) {
+                    {
+                        std::lock_guard<std::mutex> guard(shard->lock);
+                        shard->closing = true;
+                    }
+                    shard->changed.notify_all();
+                    shard->thread.join();
+
+                    if (shard->error && !error) {
+                        error = shard->error;
+                    }
+                }
+
+                if (error) {
+                    std::rethrow_exception(error);
                 }
             }
 
@@ -1019,34 +3640,254 @@ namespace Sul {
             }
             void stopListening() {
                 _listening = false;
+                _node->wake();
             }
 
             static bool Exists(std::string path) {
                 return NodeBase::Exists(path);
             }
 
+            //Most messages listen() takes off the node per read
+            static std::size_t ListenBatchSize;
+
         protected:
-            std::vector<Message*> _msg_links;
+            typedef Links<Message, &Message::_server_hook> ServerLinks;
 
-            void addLink(Message* msg) {
-                _msg_links.push_back(msg);
+            Message* _msg_links = nullptr; //Head of the list of live messages linked to this server
+            std::mutex _link_lock;
+            std::string _receive_scratch; //Swapped with each message receiveMessage reads
+
+            //Value of the scope header on messages this server creates
+            virtual const char* scope() = 0;
+
+            std::pair<PingStats, Latency::Rolling>& pingEntry(std::string const& target) {
+                auto found = _ping_stats.find(target);
+                if (found == _ping_stats.end()) {
+                    found = _ping_stats.emplace(target, std::make_pair(PingStats(), Latency::Rolling(_ping_window, 6))).first;
+                }
+
+                return found->second;
             }
-            void removeLink(Message* msg) {
-                for (int i = 0; i < _msg_links.size(); ++i) {
-                    if (_msg_links[i] == msg) {
-                        _msg_links.erase(_msg_links.begin() + i);
+            void countPings(std::map<std::string, std::chrono::nanoseconds> const& targets) {
+                std::lock_guard<std::mutex> guard(_ping_lock);
+                for (auto& target : targets) {
+                    pingEntry(target.first).first.sent++;
+                }
+            }
+            //pingMany for a server that listen() is receiving on. The replies
+            //are matched through the pending-reply table on the listening
+            //thread, so this one never competes with it for the transport.
+            std::map<std::string, std::chrono::nanoseconds> pingThroughListener(std::vector<std::string> const& targets, std::size_t timeout) {
+                typedef std::chrono::steady_clock Clock;
+
+                struct Pings {
+                    std::map<std::string, std::chrono::nanoseconds> times;
+                    std::size_t waiting = 0;
+                    std::mutex lock;
+                    std::condition_variable replied;
+                };
+                auto pings = std::make_shared<Pings>();
+                std::vector<std::string> uids;
+
+                auto cancel = [this, &uids]() {
+                    for (auto& uid : uids) {
+                        cancelReply(uid);
                     }
+                };
+
+                for (auto& target : targets) {
+                    {
+                        std::lock_guard<std::mutex> guard(pings->lock);
+                        if (!pings->times.emplace(target, std::chrono::nanoseconds::zero()).second) {
+                            continue; //Pinged once however often it's listed
+                        }
+                        pings->waiting++;
+                    }
+
+                    auto msgPing = acquireBlank();
+                    (*msgPing)[Header::Type] = "ping";
+                    auto uid = msgPing->get(Header::UID);
+                    auto sent = Clock::now();
+
+                    auto arrived = [pings, target, sent](MessageBase&) {
+                        auto time = std::chrono::duration_cast<std::chrono::nanoseconds>(Clock::now() - sent);
+                        std::lock_guard<std::mutex> guard(pings->lock);
+                        pings->times[target] = time;
+                        pings->waiting--;
+                        pings->replied.notify_all();
+                    };
+                    expectReply(uid, arrived, false);
+                    expectReply(uid, arrived, true);
+                    if (timeout) {
+                        expectTimeout(uid, timeout, nullptr);
+                    }
+                    uids.push_back(uid);
+
+                    try {
+                        msgPing->send(target);
+                    } catch (...) {
+                        cancel();
+                        throw;
+                    }
+                }
+
+                std::unique_lock<std::mutex> guard(pings->lock);
+                countPings(pings->times);
+
+                auto done = [&pings]() {
+                    return pings->waiting == 0;
+                };
+                if (timeout) {
+                    pings->replied.wait_until(guard, Clock::now() + std::chrono::milliseconds(timeout), done);
+                } else {
+                    pings->replied.wait(guard, done);
+                }
+
+                auto times = pings->times;
+                guard.unlock();
+                cancel(); //Replies still on their way go to the receive events
+
+                for (auto& time : times) {
+                    recordPing(time.first, time.second);
                 }
+
+                return times;
             }
-            void changeLink(Message* msg1, Message* msg2) {
-                for (int i = 0; i < _msg_links.size(); ++i) {
-                    if (_msg_links[i] == msg1) {
-                        _msg_links[i] = msg2;
+            //A zero 'time' records a lost ping
+            void recordPing(std::string const& target, std::chrono::nanoseconds time) {
+                std::lock_guard<std::mutex> guard(_ping_lock);
+                auto& entry = pingEntry(target);
+                if (time.count() == 0) {
+                    entry.first.lost++;
+                } else {
+                    entry.second.record(time);
+                }
+            }
+            //Parses the next message on the node into 'msg'
+            void readFromNode(Message& msg) {
+                _node->takeNextMessage(_receive_scratch);
+                auto start = std::chrono::steady_clock::now();
+                msg.parseFrom(_receive_scratch); //Hands back the message's old buffer for the next read
+                _node->learnWireFormat(msg);
+                _node->countParse(start);
+            }
+            //Writes a stats line if one is due. Returns the ms until the next
+            //is, capped at 'max' as for untilNextDeadline.
+            std::size_t logStatsIfDue(std::size_t max) {
+                std::function<void(std::string const&)> log;
+                std::size_t left;
+                {
+                    std::lock_guard<std::mutex> guard(_stats_log_lock);
+                    if (!_stats_log) {
+                        return max;
+                    }
+
+                    auto now = std::chrono::steady_clock::now();
+                    if (now >= _stats_due) {
+                        log = _stats_log;
+                        _stats_due = now + _stats_interval;
+                    }
+                    left = static_cast<std::size_t>(std::chrono::duration_cast<std::chrono::milliseconds>(_stats_due - now).count() + 1);
+                }
+
+                if (log) {
+                    log(FormatStats(getCliendID(), getStats()));
+                }
+
+                return max ? std::min(max, left) : left;
+            }
+            //An empty message linked to this server and its node
+            Message linkedMessage() {
+                Message msg;
+                msg.linkWithNode(_node);
+                msg.linkWithServer(this);
+                _node->addLink(&msg);
+                addLink(&msg);
+
+                return msg;
+            }
+            //An empty pooled message, without even a UID
+            PooledMessage acquireClean() {
+                auto msg = _pool.take();
+
+                if (!msg) {
+                    msg = _pool.add(new Message());
+                    msg->reset();
+                    msg->linkWithNode(_node);
+                    msg->linkWithServer(this);
+                    _node->addLink(msg);
+                    addLink(msg);
+                }
+
+                return PooledMessage(&_pool, msg);
+            }
+            //A pooled message with a new UID and nothing else set
+            PooledMessage acquireBlank() {
+                auto msg = acquireClean();
+                msg->renewUID();
+
+                return msg;
+            }
+
+            //A dispatch thread of a multi-threaded listen() and the messages
+            //waiting on it
+            struct ListenShard {
+                std::deque<PooledMessage> messages;
+                std::mutex lock;
+                std::condition_variable changed; //Messages added or taken, or closing set
+                bool closing = false;
+                std::exception_ptr error;
+                int unpinned = -1; //CPU the thread was meant for but couldn't be pinned to
+                std::thread thread;
+            };
+
+            void dispatchShard(ListenShard& shard) {
+                while (true) {
+                    PooledMessage msg;
+                    {
+                        std::unique_lock<std::mutex> guard(shard.lock);
+                        shard.changed.wait(guard, [&shard]() {
+                            return shard.closing || !shard.messages.empty();
+                        });
+                        if (shard.messages.empty()) {
+                            return;
+                        }
+
+                        msg = std::move(shard.messages.front());
+                        shard.messages.pop_front();
+                    }
+                    shard.changed.notify_all(); //Room for the receiver
+
+                    try {
+                        runReceiveEvents(*msg);
+                    } catch (...) {
+                        {
+                            std::lock_guard<std::mutex> guard(shard.lock);
+                            shard.error = std::current_exception();
+                        }
+                        stopListening();
+                        shard.changed.notify_all();
+                        return;
                     }
                 }
             }
+
+            void addLink(Message* msg) {
+                std::lock_guard<std::mutex> guard(_link_lock);
+                ServerLinks::Push(_msg_links, msg); //Linking twice is harmless
+            }
+            void removeLink(Message* msg) {
+                std::lock_guard<std::mutex> guard(_link_lock);
+                ServerLinks::Remove(_msg_links, msg);
+            }
+            void changeLink(Message* msg1, Message* msg2) {
+                std::lock_guard<std::mutex> guard(_link_lock);
+                ServerLinks::Replace(_msg_links, msg1, msg2);
+            }
         };
 
+        std::size_t ServerBase::ListenBatchSize = 64;
+
         class LocalServer: public ServerBase {
         public:
             LocalServer(std::string clientID) {
@@ -1064,7 +3905,7 @@ namespace Sul {
                 msg.linkWithNode(_node);
                 this->addLink(&msg); //The link is tracked across move/copy constructors
                 _node->addLink(&msg);
-                msg["scope"] = "local";
+                msg[Header::Scope] = "local";
                 return msg;
             }
             Message createMessage() {
@@ -1073,9 +3914,14 @@ namespace Sul {
                 msg.linkWithNode(_node);
                 this->addLink(&msg); //The link is tracked across move/copy constructors
                 _node->addLink(&msg);
-                msg["scope"] = "local";
+                msg[Header::Scope] = "local";
                 return msg;
             }
+
+        protected:
+            virtual const char* scope() {
+                return "local";
+            }
         };
         class RemoteServer: public ServerBase {
         public:
@@ -1092,16 +3938,21 @@ namespace Sul {
                 auto msg = Message(initializer);
                 msg.linkWithNode(this->_node);
                 this->_node->addLink(&msg); //The link is tracked across move/copy constructors
-                msg["scope"] = "remote";
+                msg[Header::Scope] = "remote";
                 return msg;
             }
             Message createMessage() {
                 auto msg = Message();
                 msg.linkWithNode(this->_node);
                 this->_node->addLink(&msg); //The link is tracked across move/copy constructors
-                msg["scope"] = "remote";
+                msg[Header::Scope] = "remote";
                 return msg;
             }
+
+        protected:
+            virtual const char* scope() {
+                return "remote";
+            }
         };
     }
 }
@@ -0,0 +1,183 @@
+#ifndef PROJECT_COMPRESSION_H
+#define PROJECT_COMPRESSION_H
+
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+namespace Sul {
+    //Byte-oriented LZ77 in the layout of an LZ4 block: each sequence is a
+    //token (literal count in the high nibble, match length - 4 in the low),
+    //any extra literal count as a run of bytes ending below 255, the
+    //literals, a 2 byte little endian offset back into the output and any
+    //extra match length. The last sequence is literals only. Matches are
+    //found through a small hash table of 4 byte runs, which suits the
+    //repetitive key/value text the Comms layer sends.
+    namespace Compression {
+        const std::size_t MinMatch = 4;
+        const std::size_t MaxOffset = 65535;
+        const unsigned int HashBits = 12;
+        const std::size_t TailLiterals = 5; //Matches stop this far from the end, as in LZ4
+
+        inline uint32_t Read32(const char* pos) {
+            uint32_t value;
+            memcpy(&value, pos, sizeof(value));
+            return value;
+        }
+
+        inline std::size_t Hash(uint32_t value) {
+            return (value * 2654435761u) >> (32 - HashBits);
+        }
+
+        inline void AppendCount(std::string& out, std::size_t count) {
+            while (count >= 255) {
+                out += static_cast<char>(255);
+                count -= 255;
+            }
+
+            out += static_cast<char>(count);
+        }
+
+        inline void AppendSequence(std::string& out, const char* literals, std::size_t literalCount, std::size_t offset, std::size_t matchLength) {
+            auto extraMatch = matchLength ? matchLength - MinMatch : 0;
+            out += static_cast<char>(((literalCount < 15 ? literalCount : 15) << 4) | (extraMatch < 15 ? extraMatch : 15));
+
+            if (literalCount >= 15) {
+                AppendCount(out, literalCount - 15);
+            }
+            out.append(literals, literalCount);
+
+            if (matchLength) {
+                out += static_cast<char>(offset & 0xff);
+                out += static_cast<char>(offset >> 8);
+                if (extraMatch >= 15) {
+                    AppendCount(out, extraMatch - 15);
+                }
+            }
+        }
+
+        //Appends the compressed form of [data, data + length) to 'out'
+        inline void Compress(const char* data, std::size_t length, std::string& out) {
+            static thread_local std::vector<uint32_t> table;
+            table.assign(static_cast<std::size_t>(1) << HashBits, 0);
+
+            std::size_t anchor = 0;
+            if (length > MinMatch + TailLiterals + 4) {
+                std::size_t limit = length - TailLiterals - MinMatch;
+                std::size_t pos = 1;
+                std::size_t misses = 0;
+
+                while (pos < limit) {
+                    auto run = Read32(data + pos);
+                    auto& slot = table[Hash(run)];
+                    std::size_t candidate = slot;
+                    slot = static_cast<uint32_t>(pos);
+
+                    if (pos - candidate > MaxOffset || Read32(data + candidate) != run) {
+                        pos += 1 + (misses++ >> 6); //Stride through data that doesn't compress
+                        continue;
+                    }
+                    misses = 0;
+
+                    auto match = MinMatch;
+                    while (pos + match < length - TailLiterals && data[candidate + match] == data[pos + match]) {
+                        ++match;
+                    }
+
+                    AppendSequence(out, data + anchor, pos - anchor, pos - candidate, match);
+                    pos += match;
+                    anchor = pos;
+                }
+            }
+
+            AppendSequence(out, data + anchor, length - anchor, 0, 0);
+        }
+
+        inline std::size_t ReadCount(const unsigned char*& pos, const unsigned char* end) {
+            std::size_t count = 0;
+            unsigned char byte;
+            do {
+                if (pos >= end) {
+                    throw std::runtime_error("Compression::Decompress - truncated input");
+                }
+                byte = *pos++;
+                count += byte;
+            } while (byte == 255);
+
+            return count;
+        }
+
+        //Decompresses [data, data + length) into 'out', which is resized to
+        //the 'expected' length the input must produce
+        inline void Decompress(const char* data, std::size_t length, std::size_t expected, std::string& out) {
+            //No input byte expands to more than 255, so a bogus length is
+            //caught before it is allocated
+            if (expected / 255 > length) {
+                throw std::runtime_error("Compression::Decompress - expected length is out of range");
+            }
+
+            out.resize(expected);
+            auto pos = reinterpret_cast<const unsigned char*>(data);
+            auto end = pos + length;
+            std::size_t written = 0;
+
+            while (true) {
+                if (pos >= end) {
+                    throw std::runtime_error("Compression::Decompress - truncated input");
+                }
+
+                auto token = *pos++;
+                std::size_t literals = token >> 4;
+                if (literals == 15) {
+                    literals += ReadCount(pos, end);
+                }
+                if (literals > static_cast<std::size_t>(end - pos) || literals > expected - written) {
+                    throw std::runtime_error("Compression::Decompress - literals run past the end");
+                }
+
+                memcpy(&out[0] + written, pos, literals);
+                pos += literals;
+                written += literals;
+
+                if (pos == end) {
+                    break;
+                }
+
+                if (end - pos < 2) {
+                    throw std::runtime_error("Compression::Decompress - truncated input");
+                }
+                std::size_t offset = pos[0] | (static_cast<std::size_t>(pos[1]) << 8);
+                pos += 2;
+
+                std::size_t match = (token & 0x0f) + MinMatch;
+                if ((token & 0x0f) == 15) {
+                    match += ReadCount(pos, end);
+                }
+                if (offset == 0 || offset > written || match > expected - written) {
+                    throw std::runtime_error("Compression::Decompress - match out of range");
+                }
+
+                char* to = &out[0] + written;
+                const char* from = to - offset;
+                if (offset >= match) {
+                    memcpy(to, from, match);
+                } else {
+                    //Byte at a time, as the match overlaps what it copies
+                    for (std::size_t i = 0; i < match; ++i) {
+                        to[i] = from[i];
+                    }
+                }
+                written += match;
+            }
+
+            if (written != expected) {
+                throw std::runtime_error("Compression::Decompress - output is shorter than expected");
+            }
+        }
+    }
+}
+
+#endif //PROJECT_COMPRESSION_H
@@ -0,0 +1,212 @@
+#ifndef PROJECT_LATENCY_H
+#define PROJECT_LATENCY_H
+
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+
+namespace Sul {
+    namespace Latency {
+        //Times in nanoseconds; the percentiles are within about 3% of the
+        //true value
+        struct Summary {
+            uint64_t count = 0;
+            uint64_t min = 0;
+            uint64_t max = 0;
+            uint64_t mean = 0;
+            uint64_t p50 = 0;
+            uint64_t p99 = 0;
+            uint64_t p999 = 0;
+        };
+
+        //Log-linear histogram of nanosecond values: each power of two is
+        //split into 16 equal buckets, so the memory used is fixed and small
+        //whatever the range. Values from about 18 minutes up share the last
+        //bucket.
+        class Histogram {
+            static const unsigned int SubBits = 4;
+            static const unsigned int MaxBits = 40;
+            static const uint64_t SubCount = 1ULL << SubBits;
+
+            std::vector<uint64_t> _buckets;
+            uint64_t _count = 0;
+            uint64_t _min = 0;
+            uint64_t _max = 0;
+            uint64_t _sum = 0; //Wraps after about 584 years of total time
+
+            static unsigned int HighestBit(uint64_t value) {
+                unsigned int bit = 0;
+                while (value >>= 1) {
+                    ++bit;
+                }
+
+                return bit;
+            }
+            static std::size_t Bucket(uint64_t value) {
+                if (value < SubCount) {
+                    return static_cast<std::size_t>(value);
+                }
+
+                auto bit = HighestBit(value);
+                if (bit >= MaxBits) {
+                    return BucketCount() - 1;
+                }
+
+                auto shift = bit - SubBits;
+                return static_cast<std::size_t>((shift + 1) * SubCount + ((value >> shift) - SubCount));
+            }
+            //Midpoint of the values that fall in 'bucket'
+            static uint64_t Value(std::size_t bucket) {
+                if (bucket < SubCount) {
+                    return bucket;
+                }
+
+                auto shift = static_cast<unsigned int>(bucket / SubCount - 1);
+                auto low = (SubCount + bucket % SubCount) << shift;
+
+                return low + ((1ULL << shift) >> 1);
+            }
+            static std::size_t BucketCount() {
+                return static_cast<std::size_t>((MaxBits - SubBits + 1) * SubCount);
+            }
+
+        public:
+            Histogram(): _buckets(BucketCount(), 0) {}
+
+            void record(uint64_t value) {
+                _buckets[Bucket(value)]++;
+                _min = _count == 0 || value < _min ? value : _min;
+                _max = value > _max ? value : _max;
+                _sum += value;
+                _count++;
+            }
+            void record(std::chrono::nanoseconds value) {
+                record(static_cast<uint64_t>(value.count() < 0 ? 0 : value.count()));
+            }
+            void merge(Histogram const& other) {
+                if (other._count == 0) {
+                    return;
+                }
+
+                for (std::size_t i = 0; i < _buckets.size(); ++i) {
+                    _buckets[i] += other._buckets[i];
+                }
+                _min = _count == 0 || other._min < _min ? other._min : _min;
+                _max = other._max > _max ? other._max : _max;
+                _sum += other._sum;
+                _count += other._count;
+            }
+            void reset() {
+                _buckets.assign(_buckets.size(), 0);
+                _count = _min = _max = _sum = 0;
+            }
+
+            uint64_t count() const {
+                return _count;
+            }
+            //Value at or below which 'fraction' (0 to 1) of the values fall
+            uint64_t percentile(double fraction) const {
+                if (_count == 0) {
+                    return 0;
+                }
+
+                auto rank = static_cast<uint64_t>(fraction * _count + 0.5);
+                rank = rank < 1 ? 1 : rank > _count ? _count : rank;
+
+                uint64_t seen = 0;
+                for (std::size_t i = 0; i < _buckets.size(); ++i) {
+                    seen += _buckets[i];
+                    if (seen >= rank) {
+                        auto value = Value(i);
+                        return value < _min ? _min : value > _max ? _max : value;
+                    }
+                }
+
+                return _max;
+            }
+            Summary summary() const {
+                Summary summary;
+                summary.count = _count;
+                if (_count) {
+                    summary.min = _min;
+                    summary.max = _max;
+                    summary.mean = _sum / _count;
+                    summary.p50 = percentile(0.5);
+                    summary.p99 = percentile(0.99);
+                    summary.p999 = percentile(0.999);
+                }
+
+                return summary;
+            }
+        };
+
+        //Histogram over a sliding window of time, kept as a ring of slices
+        //that each cover window / slices. Whole slices age out, so the window
+        //covered is between window - window / slices and window long.
+        class Rolling {
+            typedef std::chrono::steady_clock Clock;
+
+            std::vector<Histogram> _slices;
+            std::vector<int64_t> _epochs; //Which span of time each slice holds
+            Clock::duration _span;
+
+            int64_t epoch(Clock::time_point now) const {
+                return now.time_since_epoch() / _span;
+            }
+
+        public:
+            //A minute in 6 slices
+            Rolling(): Rolling(std::chrono::milliseconds(60000), 6) {}
+            Rolling(std::chrono::milliseconds window, std::size_t slices):
+                    _slices(slices ? slices : 1), _epochs(_slices.size(), -1) {
+                _span = std::chrono::duration_cast<Clock::duration>(window) / static_cast<int64_t>(_slices.size());
+                if (_span <= Clock::duration::zero()) {
+                    _span = Clock::duration(1);
+                }
+            }
+
+            void record(std::chrono::nanoseconds value) {
+                record(value, Clock::now());
+            }
+            void record(std::chrono::nanoseconds value, Clock::time_point now) {
+                auto current = epoch(now);
+                auto index = static_cast<std::size_t>(current % static_cast<int64_t>(_slices.size()));
+
+                if (_epochs[index] != current) {
+                    _slices[index].reset();
+                    _epochs[index] = current;
+                }
+                _slices[index].record(value);
+            }
+            void reset() {
+                for (auto& slice : _slices) {
+                    slice.reset();
+                }
+                _epochs.assign(_epochs.size(), -1);
+            }
+
+            //The slices still inside the window, merged
+            Histogram window() const {
+                return window(Clock::now());
+            }
+            Histogram window(Clock::time_point now) const {
+                auto current = epoch(now);
+                Histogram merged;
+
+                for (std::size_t i = 0; i < _slices.size(); ++i) {
+                    if (_epochs[i] >= 0 && current - _epochs[i] < static_cast<int64_t>(_slices.size())) {
+                        merged.merge(_slices[i]);
+                    }
+                }
+
+                return merged;
+            }
+            Summary summary() const {
+                return window().summary();
+            }
+        };
+    }
+}
+
+#endif //PROJECT_LATENCY_H
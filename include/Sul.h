@@ -3,9 +3,26 @@
 
 #include <vector>
 #include <string>
-#include <windows.h>
 #include <stdexcept>
 
+#ifdef _WIN32
+#include <windows.h>
+#else
+#include <dlfcn.h>
+#include <unistd.h>
+#include <climits>
+
+//Minimal stand-ins for the Win32 names used throughout the headers, so the
+//POSIX builds can share the same class definitions
+typedef void* HANDLE;
+typedef void* HINSTANCE;
+typedef void* FARPROC;
+
+inline void Sleep(unsigned int ms) {
+    usleep(ms * 1000);
+}
+#endif
+
 namespace Sul {
     class DynamicLibrary {
         std::string DLLPath;
@@ -31,6 +48,7 @@ namespace Sul {
                 freeDLL();
             }
 
+#ifdef _WIN32
             hDLL = LoadLibrary(DLLPath.c_str());
 
             if (!hDLL) {
@@ -42,25 +60,61 @@ namespace Sul {
                     default: throw std::runtime_error("LoadLibrary failed with error code " + std::to_string(err) + " when trying to load DLL from path: " + DLLPath);
                 }
             }
+#else
+            //LoadLibrary searches the executable's directory first; dlopen doesn't,
+            //so try there before falling back to the normal search path
+            if (DLLPath.find('/') == std::string::npos) {
+                char exe[PATH_MAX];
+                auto len = readlink("/proc/self/exe", exe, sizeof(exe) - 1);
+
+                if (len > 0) {
+                    std::string dir(exe, (std::size_t) len);
+                    hDLL = dlopen((dir.substr(0, dir.find_last_of('/') + 1) + DLLPath).c_str(), RTLD_NOW);
+                }
+            }
+
+            if (!hDLL) {
+                hDLL = dlopen(DLLPath.c_str(), RTLD_NOW);
+            }
+
+            if (!hDLL) {
+                const char* err = dlerror();
+                throw std::runtime_error("dlopen failed (" + std::string(err ? err : "unknown error") + ") when trying to load DLL from path: " + DLLPath);
+            }
+#endif
         }
         void freeDLL() {
             requireDLL("Cannot free DLL \"" + DLLPath + "\" as it is not currently loaded.");
 
+#ifdef _WIN32
             auto success = FreeLibrary(hDLL);
 
             if (!success) {
                 throw std::runtime_error("FreeLibrary failed with error code " + std::to_string(success) + " when trying to free DLL at path: " + DLLPath);
             }
+#else
+            if (dlclose(hDLL) != 0) {
+                throw std::runtime_error("dlclose failed (" + std::string(dlerror()) + ") when trying to free DLL at path: " + DLLPath);
+            }
+#endif
+            hDLL = nullptr;
         }
 
         FARPROC getProcAddress(std::string proc_name) {
             requireDLL("getProcAddress cannot run as the DLL \"" + DLLPath + "\" isn't loaded.");
 
+#ifdef _WIN32
             auto proc = GetProcAddress(hDLL, proc_name.c_str());
             if (!proc) {
                 auto err = GetLastError();
                 throw std::runtime_error("GetProcAddress failed with error code " + std::to_string(err) + " when trying to load procedure \"" + proc_name +"\" from path: " + DLLPath);
             }
+#else
+            FARPROC proc = dlsym(hDLL, proc_name.c_str());
+            if (!proc) {
+                throw std::runtime_error("dlsym failed when trying to load procedure \"" + proc_name +"\" from path: " + DLLPath);
+            }
+#endif
 
             return proc;
         }
@@ -1,11 +1,26 @@
 #ifndef PROJECT_THREADING_H
 #define PROJECT_THREADING_H
 
+#include <atomic>
+#include <condition_variable>
+#include <cstddef>
+#include <deque>
 #include <functional>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+#ifdef _WIN32
 #include <windows.h>
+#elif defined(__linux__)
+#include <pthread.h>
+#include <sched.h>
+#endif
 
 namespace Sul {
     namespace Threading {
+#ifdef _WIN32
         template<class Type, class... Args>
         class Thread {
             std::function<Type(Args)> _thread_func;
@@ -28,6 +43,242 @@ namespace Sul {
 
             }
         };
+#endif
+
+        //Pins the calling thread to one CPU. Returns false if the OS refused
+        //or pinning isn't supported here.
+        inline bool PinCurrentThread(unsigned int cpu) {
+#ifdef _WIN32
+            if (cpu >= sizeof(DWORD_PTR) * 8) {
+                return false;
+            }
+
+            return SetThreadAffinityMask(GetCurrentThread(), static_cast<DWORD_PTR>(1) << cpu) != 0;
+#elif defined(__linux__)
+            if (cpu >= CPU_SETSIZE) {
+                return false;
+            }
+
+            cpu_set_t set;
+            CPU_ZERO(&set);
+            CPU_SET(cpu, &set);
+
+            return pthread_setaffinity_np(pthread_self(), sizeof(set), &set) == 0;
+#else
+            return false;
+#endif
+        }
+
+        //Counts down from a fixed number once. Until the last count, count
+        //downs are a single atomic operation; only the last one takes the
+        //lock to wake waiters.
+        class Latch {
+            std::atomic<std::size_t> _count;
+            std::mutex _lock;
+            std::condition_variable _done;
+
+        public:
+            explicit Latch(std::size_t count): _count(count) {}
+            Latch(Latch const&) = delete;
+            Latch& operator=(Latch const&) = delete;
+
+            void countDown() {
+                auto count = _count.load(std::memory_order_acquire);
+                while (count > 1) {
+                    if (_count.compare_exchange_weak(count, count - 1, std::memory_order_acq_rel)) {
+                        return;
+                    }
+                }
+
+                //The last count is made under the lock, so once a waiter has
+                //seen zero and taken the lock itself, nothing will touch the
+                //latch again
+                std::lock_guard<std::mutex> guard(_lock);
+                _count.store(0, std::memory_order_release);
+                _done.notify_all();
+            }
+            bool tryWait() {
+                if (_count.load(std::memory_order_acquire) != 0) {
+                    return false;
+                }
+
+                std::lock_guard<std::mutex> guard(_lock);
+                return true;
+            }
+            void wait() {
+                std::unique_lock<std::mutex> guard(_lock);
+                _done.wait(guard, [this]() {
+                    return _count.load(std::memory_order_acquire) == 0;
+                });
+            }
+        };
+
+        //Fixed set of threads running submitted tasks. Each worker has its own
+        //queue: tasks submitted from a worker go on the back of its queue and
+        //others are dealt out round robin. A worker takes from the back of its
+        //own queue and, once that is empty, steals from the front of the
+        //others'. Tasks must not throw.
+        class WorkerPool {
+            struct Worker {
+                std::deque<std::function<void()>> tasks;
+                std::mutex lock;
+            };
+
+            std::vector<std::unique_ptr<Worker>> _workers;
+            std::vector<std::thread> _threads;
+            std::atomic<std::size_t> _next{0}; //Round robin position for outside submissions
+            std::atomic<std::size_t> _queued{0};
+            std::atomic<std::size_t> _busy{0};
+            std::mutex _sleep_lock;
+            std::condition_variable _wake;
+            bool _stopping = false; //Guarded by _sleep_lock
+
+            //The pool and worker index of the calling thread, if it is a worker
+            static WorkerPool*& CurrentPool() {
+                static thread_local WorkerPool* pool = nullptr;
+                return pool;
+            }
+            static std::size_t& CurrentIndex() {
+                static thread_local std::size_t index = 0;
+                return index;
+            }
+
+            bool pop(std::size_t index, std::function<void()>& task) {
+                auto& worker = *_workers[index];
+                std::lock_guard<std::mutex> guard(worker.lock);
+                if (worker.tasks.empty()) {
+                    return false;
+                }
+
+                task = std::move(worker.tasks.back());
+                worker.tasks.pop_back();
+                _queued.fetch_sub(1);
+
+                return true;
+            }
+            bool steal(std::size_t index, std::function<void()>& task) {
+                for (std::size_t i = 1; i < _workers.size(); ++i) {
+                    auto& victim = *_workers[(index + i) % _workers.size()];
+                    std::lock_guard<std::mutex> guard(victim.lock);
+                    if (!victim.tasks.empty()) {
+                        task = std::move(victim.tasks.front());
+                        victim.tasks.pop_front();
+                        _queued.fetch_sub(1);
+
+                        return true;
+                    }
+                }
+
+                return false;
+            }
+            //Takes a task for worker 'index', its own first
+            bool take(std::size_t index, std::function<void()>& task) {
+                return pop(index, task) || steal(index, task);
+            }
+            void run(std::function<void()>& task) {
+                _busy.fetch_add(1);
+                task();
+                task = nullptr;
+                _busy.fetch_sub(1);
+            }
+
+            void work(std::size_t index) {
+                CurrentPool() = this;
+                CurrentIndex() = index;
+
+                std::function<void()> task;
+                while (true) {
+                    if (take(index, task)) {
+                        run(task);
+                        continue;
+                    }
+
+                    std::unique_lock<std::mutex> guard(_sleep_lock);
+                    _wake.wait(guard, [this]() {
+                        return _stopping || _queued.load() > 0;
+                    });
+
+                    if (_stopping && _queued.load() == 0) {
+                        return;
+                    }
+                }
+            }
+
+        public:
+            //One worker per hardware thread
+            WorkerPool(): WorkerPool(std::thread::hardware_concurrency()) {}
+            explicit WorkerPool(std::size_t threads) {
+                if (threads == 0) {
+                    threads = 1;
+                }
+
+                for (std::size_t i = 0; i < threads; ++i) {
+                    _workers.emplace_back(new Worker());
+                }
+                for (std::size_t i = 0; i < threads; ++i) {
+                    _threads.emplace_back(&WorkerPool::work, this, i);
+                }
+            }
+            WorkerPool(WorkerPool const&) = delete;
+            WorkerPool& operator=(WorkerPool const&) = delete;
+            //Runs every task already submitted, then joins the workers
+            ~WorkerPool() {
+                {
+                    std::lock_guard<std::mutex> guard(_sleep_lock);
+                    _stopping = true;
+                }
+                _wake.notify_all();
+
+                for (auto& thread : _threads) {
+                    thread.join();
+                }
+            }
+
+            void submit(std::function<void()> task) {
+                std::size_t index = CurrentPool() == this ? CurrentIndex() : _next.fetch_add(1) % _workers.size();
+                _queued.fetch_add(1); //Counted first so it never drops below zero
+                {
+                    std::lock_guard<std::mutex> guard(_workers[index]->lock);
+                    _workers[index]->tasks.push_back(std::move(task));
+                }
+
+                //A worker about to sleep checks _queued under this lock, so
+                //taking it here means the wake can't slip in before the sleep
+                {
+                    std::lock_guard<std::mutex> guard(_sleep_lock);
+                }
+                _wake.notify_one();
+            }
+            //Blocks until 'latch' is released. Called from a worker, it runs
+            //queued tasks in the meantime, so tasks can wait on tasks they
+            //submit without tying up the pool.
+            void wait(Latch& latch) {
+                if (CurrentPool() == this) {
+                    std::function<void()> task;
+                    while (!latch.tryWait()) {
+                        if (!take(CurrentIndex(), task)) {
+                            break;
+                        }
+                        run(task);
+                    }
+                }
+
+                latch.wait();
+            }
+
+            std::size_t size() const {
+                return _workers.size();
+            }
+            //Workers not running a task right now
+            std::size_t idle() const {
+                auto busy = _busy.load();
+                return busy < _workers.size() ? _workers.size() - busy : 0;
+            }
+            //Tasks submitted but not yet started
+            std::size_t queued() const {
+                return _queued.load();
+            }
+        };
     }
 }
 